@@ -0,0 +1,41 @@
+#ifndef __BLKDEV_H__
+#define __BLKDEV_H__
+
+// 块设备层
+// 每个设备号对应一个块设备, buf 和 dirent 中的 dev 就是这里的下标.
+// 驱动只需要提供下面的操作, 排序, 合并, 期限由 disk.c 的 I/O 调度完成
+
+#define NBLKDEV 4
+
+struct blkdev_ops {
+  // 提交扇区连续的 n 个缓冲块, 可以立即返回.
+  // 完成时清除 b->disk, wakeup(b), 然后调用 b->end_io
+  void (*submit)(struct buf **, int, int);
+  void (*wait)(struct buf *);   // 等待缓冲块上的请求完成
+  int  (*inflight)(void);       // 设备中还没有完成的请求数
+  void (*plug)(void);           // 可选, 批量提交时只通知设备一次
+  void (*unplug)(void);
+  void (*info)(void);           // 可选, 输出驱动的统计信息
+};
+
+struct blkdev {
+  char name[8];
+  struct blkdev_ops *ops;
+  uint64 nsec;          // 容量, 扇区数
+  int depth;            // 同时交给设备的请求数上限
+
+  // I/O 调度队列
+  struct spinlock lock;
+  struct buf *rq;       // 读队列, 按 sectorno 排序
+  struct buf *wq;       // 写队列
+  int plugged;
+  int busy;             // 已经摘下还没交给设备的请求数
+  uint pos;             // 电梯的位置, 上次派发的末尾扇区
+  int starved;          // 写被读跳过的次数
+  uint64 nmerge;        // 合并掉的请求数
+};
+
+void        blkdev_register(int, char *, struct blkdev_ops *, uint64, int);
+struct blkdev *blkdev_get(int);
+
+#endif // !__BLKDEV_H__
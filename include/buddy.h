@@ -2,7 +2,10 @@
 #define __BUDDY_H__
 
 // 用于匹配需要分配块大小对应的等级,保存在每一个块的头部
-#define GET_LEVEL(b)  (*((uint *)b - 1))
+#define GET_LEVEL(b)  (*((uint64 *)b - 1))
+
+// 块头部的大小
+#define BUDDY_HDR     sizeof(uint64)
 
 // 计算出该等级对应需要分配块的大小
 #define LEVEL_2_SIZE(lv)  (1 << (lv))
@@ -10,16 +13,20 @@
 // 最小的分配块的等级对应16字节
 #define  MIN_LEVEL 4
 
-// 最大的分配块的等级对应4096字节
+// 最大的分配块的等级对应4096字节, 即一整页
+// 需要整页或更大的分配按页进行, 不经过伙伴链表
 #define MAX_LEVEL 12
 
+// 空闲块, 最小的块(16字节)正好放下两个指针
 struct buddy {
   struct buddy *next;
+  struct buddy *prev;
 };
 
 void        buddyinit();
 void *      malloc(size_t);
 void        free(void *);
 void        mem_info();
+void        buddy_bench();
 
 #endif // !__BUDDY_H__
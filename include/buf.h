@@ -11,14 +11,25 @@
 
 struct buf {
   int valid;   // has data been read from disk?
-  int disk;    // does disk "own" buf?,  表示该缓冲区的数据已经写到磁盘, 缓冲区中的内容可能会发生变化
+  int disk;    // does disk "own" buf?,  有I/O请求正在进行, 完成时由中断清零
   uint dev;
-  uint sectorno;
+  uint sectorno;    // 起始扇区
+  uint size;        // 数据字节数, BSIZE 的整数倍, 数据区按簇缓存
   struct sleeplock lock;
   uint refcnt;      // 引用次数
-  struct buf *prev; // LRU cache list
+  uchar refbit;     // 最近被访问过, CLOCK 替换时给第二次机会
+  uchar hashed;     // 是否在散列链中
+  uchar dirty;      // 数据被修改过, 还没有写回磁盘
+  uchar ra;         // 预读进来的, 还没有被使用过
+  uchar error;      // 上一次I/O失败, 数据无效
+  struct buf *prev; // 所有缓冲块组成的时钟环
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *hnext; // 散列链
+  uchar *data;      // size 字节, 从 kalloc 的页中分配, 物理地址连续
+  void (*end_io)(struct buf *); // I/O 完成时在中断中调用, 不能睡眠
+  struct buf *iolink; // 同一个磁盘请求中的下一个缓冲块
+  struct buf *qnext;  // I/O 调度队列, 按扇区排序
+  uint64 qdeadline;   // 在调度队列中等待的期限
 };
 
 
@@ -28,6 +28,7 @@ void        yield(void);
 void        scheduler();
 pagetable_t proc_pagetable(struct proc *);
 void        forkret(void);
+struct proc*kthread_create(void (*)(void), char *);
 void        wakeup(void *);
 
 // string.c
@@ -56,6 +57,17 @@ void        kinit();
 void        kfree(void *);
 void        freerange(void *, void *);
 void *      kalloc();
+void *      kalloc_flags(int);
+void *      kalloc_pages(int);
+void        kfree_pages(void *, int);
+void *      kalloc_run(int);
+void        kfree_run(void *, int);
+int         kmem_frag(int);
+void        register_shrinker(int (*)(int));
+int         kshrink(int);
+void        kalloc_bench();
+void        kzero_refill();
+void        kmem_info();
 
 // vm.c
 void        kvmmap(pagetable_t, uint64, uint64, uint64, int);
@@ -87,6 +99,17 @@ void        binit();
 struct buf* bread(uint dev, uint sectorno);
 void        bwrite(struct buf *);
 void        brelse(struct buf *);
+int         bshrink(int);
+struct buf* bread_size(uint, uint, uint);
+struct buf* bread_async(uint, uint, uint);
+void        bwait(struct buf *);
+int         bpoll(struct buf *);
+struct buf* bclear(uint, uint, uint);
+void        bdwrite(struct buf *);
+int         bsync(void);
+int         breadahead(uint, uint, uint);
+void        bcache_info(void);
+void        bthreadinit(void);
 
 
 // spinlock.c
@@ -100,6 +123,7 @@ int       holding(struct spinlock *);
 // sleeplock.c
 void      initsleeplock(struct sleeplock *, char *name);
 void      acquiresleeplock(struct sleeplock *);
+int       tryacquiresleeplock(struct sleeplock *);
 int       holdingsleep(struct sleeplock *);
 void      releasesleeplock(struct sleeplock *);
 
@@ -121,6 +145,16 @@ void      devinit();
 void      virtiointr();
 void      Virtioread(struct buf* buf, int sectorno);
 void      Virtiowrite(struct buf* buf, int sectorno);
+void      virtio_submit(struct buf* buf, int sectorno, int write);
+void      virtio_submit_sg(struct buf** bufs, int n, int write);
+void      virtio_wait(struct buf* buf);
+void      virtio_plug(void);
+void      virtio_unplug(void);
+void      virtio_bench(void);
+void      virtio_info(void);
+int       virtio_inflight(void);
+int       virtio_depth(void);
+uint64    virtio_capacity(void);
 
 // syscall.c
 void      syscall(void);
@@ -129,8 +163,18 @@ void      syscall(void);
 void disk_init();
 void disk_read(struct buf* b);
 void disk_write(struct buf* b);
+int  disk_submit(struct buf* b, int write);
+void disk_submit_sg(struct buf** bufs, int n, int write);
+void disk_wait(struct buf* b);
+void disk_plug(void);
+void disk_unplug(void);
+void disk_kick(void);
+void disk_info(void);
 void disk_intr();
 
+// ramdisk.c
+void            ramdisk_init(int dev);
+
 //fat32.c
 int fat32_init();
 struct dirent *dirlookup(struct dirent *dp, char *filename, uint *poff);
@@ -150,6 +194,10 @@ struct dirent*  ename(char *path);
 struct dirent*  enameparent(char *path, char *name);
 int             eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n);
 int             ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n);
+uint            ereadahead(struct dirent *entry, uint off, int nclus, uint done);
+int             efallocate(struct dirent *entry, uint off, uint len);
+void            fat32_sync(void);
+void            fat32_statfs(uint *clus_size, uint *nclus, uint *nfree);
 
 // file.c
 void            fileinit(void);
\ No newline at end of file
@@ -24,6 +24,13 @@
 #define ENTRY_CACHE_NUM        50
 
 
+/* 簇链中物理上连续的一段: 文件的第 idx 个簇起的 len 个簇从 clus 开始 */
+struct extent {
+    uint32 idx;
+    uint32 clus;
+    uint32 len;
+};
+
 /* struct directory */
 struct dirent {
     char filename[FAT32_MAX_FILENAME + 1];
@@ -38,10 +45,18 @@ struct dirent {
     uint32 file_size;
     uint32 cur_clus;
     uint   clus_cnt;
+    struct extent *ext;   /* 簇链的段映射, 按需建立 */
+    int    nextent;       /* 段数 */
+    int    ext_cap;
 
     /* for os */
     uchar dev;
     uchar dirty;
+    uchar hashed;         /* 在目录项散列表中 */
+    uint32 id;            /* 每次被重新使用时更换, 子目录项和负缓存用它标识父目录 */
+    uint32 pid;           /* 散列时父目录的 id */
+    uint32 hash;          /* 文件名的散列值 */
+    struct dirent* hnext;
     short valid;
     int ref;
     uint32 off;           /*游标  offset in the parent dir entry, for writing convenience */
@@ -13,6 +13,11 @@ struct file {
   struct dirent *ep;
   uint off;          // FD_ENTRY
   short major;       // FD_DEVICE
+
+  // 顺序读检测和预读, FD_ENTRY
+  uint ra_next;      // 顺序读时下一次读的偏移
+  uint ra_end;       // 已经发出预读的簇序号的终点
+  int ra_win;        // 预读窗口, 以簇为单位
 };
 
 struct devsw {
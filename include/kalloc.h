@@ -0,0 +1,12 @@
+#ifndef __KALLOC_H__
+#define __KALLOC_H__
+
+// kalloc_flags() 的分配标志
+#define KALLOC_RAW     0x0    // 不初始化, 内容未定义
+#define KALLOC_ZERO    0x1    // 清零, 优先使用预清零的页
+#define KALLOC_POISON  0x2    // 填充垃圾数据, 调试用
+
+// kalloc_pages() 一次最多分配 2^MAX_ORDER 页
+#define MAX_ORDER      10
+
+#endif // !__KALLOC_H__
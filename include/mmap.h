@@ -15,5 +15,6 @@ struct vma {
 void                mmap_free();
 int                 LoadIfContain(pagetable_t, uint64);
 struct vma *        allocvma();
+void                freevma(struct vma *);
 void                InitVmaTable();
 #endif // !__MMAP_H_
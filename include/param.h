@@ -3,8 +3,16 @@
 
 #define NPROC   64
 #define NCPU    2
-#define NBUF    20
+#define NBUF    20  /* buffer cache 初始的缓冲块数 */
+#define BCACHE_PCT 25 /* buffer cache 最多占用物理内存的百分比 */
+#define BFLUSH_TICKS 30 /* 脏缓冲块最多在内存中停留的时钟周期数 */
+#define MAXSEG  8   /* 一次磁盘请求最多包含的缓冲块数 */
 #define NDEV    10
+#define ROOTDEV 0   /* 根文件系统所在的块设备 */
+#define RAMDEV  1   /* 内存盘的设备号 */
+#define RAMDISK_KB 2048 /* 内存盘的容量 */
+#define FATCACHE 1  /* FAT 表缓存在内存中, 写回每一个 FAT 副本 */
+#define FATCACHE_MAX 64 /* FAT 缓存最多占用的页数 */
 #define BSIZE   512
 #define NOFILE  120
 #define MAXOPBLOCKS 10
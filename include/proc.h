@@ -109,6 +109,7 @@ struct proc {
   char name[16];               // Process name (debugging)
   int  sticks;        // 用户状态下运行的时间
   int  uticks;        // 内核状态下运行的时间
+  void (*kfn)(void);  // 内核线程的入口函数
 };
 
 #endif // !__PROC_H__
@@ -0,0 +1,56 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+// 对象缓存(slab)分配器
+// 每个slab占一页物理内存, 页首放 struct slab, 其余切成大小相同的对象
+
+#define SLAB_NAME 16    // 缓存名字的最大长度
+#define SLAB_MAG  16    // 每个hart的对象缓存(magazine)容量
+
+struct kmem_cache;
+
+struct slab {
+  struct slab *next;
+  struct slab *prev;
+  struct kmem_cache *cache;
+  void *freelist;       // 空闲对象链表
+  int inuse;            // 已分配出去的对象数
+};
+
+struct kmem_cache {
+  char name[SLAB_NAME];
+  uint objsize;         // 调用者要求的对象大小
+  uint size;            // 对象实际占用的大小(对齐, 可能包含空闲链表指针)
+  uint freeoff;         // 空闲链表指针在对象中的偏移
+  uint nperslab;        // 每个slab的对象数
+  void (*ctor)(void *); // 对象第一次创建时调用, 释放回来的对象应保持构造后的状态
+
+  struct spinlock lock;
+  struct slab partial;  // 部分空闲的slab
+  struct slab full;     // 全部分配出去的slab
+  struct slab empty;    // 全部空闲的slab, 最多保留一个
+
+  // 每个hart一个, 平时只有本hart访问, 锁没有竞争;
+  // kmem_cache_shrink 要清空所有hart的 magazine, 所以仍然加锁.
+  // 锁的顺序: mag.lock -> lock
+  struct {
+    struct spinlock lock;
+    int count;
+    void *obj[SLAB_MAG];
+    uint64 nalloc;      // 统计信息, 由 mag.lock 保护
+    uint64 nfree;
+  } mag[NCPU];
+
+  int nslab;            // 由 lock 保护
+
+  struct kmem_cache *next;  // 所有缓存串成链表, 给 slab_info 用
+};
+
+void        slabinit();
+void        kmem_cache_init(struct kmem_cache *, char *, uint, void (*)(void *));
+void *      kmem_cache_alloc(struct kmem_cache *);
+void        kmem_cache_free(struct kmem_cache *, void *);
+void        kmem_cache_shrink(struct kmem_cache *);
+void        slab_info();
+
+#endif // !__SLAB_H__
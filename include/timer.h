@@ -3,5 +3,6 @@
 
 extern int ticks;
 #define intervel 1000000    // 时钟周期
+#define CLOCK_FREQ 10000000 // qemu virt 的 time 寄存器频率 10MHz
 
 #endif
@@ -32,6 +32,7 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific config; blk capacity (u64, sectors) first
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -50,7 +51,9 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// 每个请求3个描述符, 最多 NUM / 3 个请求同时在设备中;
+// 支持间接描述符时每个请求只占一个, 最多 NUM 个
+#define NUM 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -61,13 +64,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // buffer contains a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // EVENT_IDX: used->idx 越过它时设备才发中断
 };
 
 // one entry in the "used" ring, with which the
@@ -81,8 +85,21 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // EVENT_IDX: avail->idx 越过它时驱动才需要通知设备
 };
 
+// EVENT_IDX: idx 从 old 增加到 new 时是否越过了 event
+#define VRING_NEED_EVENT(event, new, old) \
+  ((uint16)((new) - (event) - 1) < (uint16)((new) - (old)))
+
+// 混合轮询: 不超过 VIRTIO_POLL_SIZE 的请求先自旋最多 VIRTIO_POLL_US 微秒
+// 再睡眠等待中断, VIRTIO_POLL_US 为0时关闭
+#define VIRTIO_POLL_US   20
+#define VIRTIO_POLL_SIZE 4096
+
+// 延迟直方图, 第i格统计 [2^i, 2^(i+1)) 微秒
+#define LAT_BUCKETS 16
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
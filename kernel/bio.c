@@ -9,20 +9,184 @@
 #include "sleeplock.h"
 #include "buf.h"
 #include "riscv.h"
+#include "memlayout.h"
+#include "slab.h"
+#include "timer.h"
 #include "defs.h"
 
 
-/* 缓冲区为一个双向链表 */
+#define NBUCKET 13
+#define BHASH(dev, sectorno) (((dev) * 31 + (sectorno)) % NBUCKET)
+
+// 缓冲块数据最多占用的字节数
+#define BCACHE_MAX ((PHYSTOP - KERNBASE) / 100 * BCACHE_PCT)
+
+// 写回线程每次最多写回的缓冲块数, 按扇区号排序后依次写
+#define BFLUSH_BATCH 32
+
+// 预读队列长度, 满了就丢弃新的预读请求
+#define RA_QSIZE 32
+
+/*
+ * 缓冲块大小可变: FAT 等元数据按扇区缓存, 数据区按簇缓存,
+ * 同一扇区不会同时出现在两种缓冲块中.
+ * 缓冲块的个数是动态的: 未命中时先增长, 数据总量达到 BCACHE_MAX 后才替换,
+ * 全部被引用时等待, 内存紧张时由 kalloc 回调 bshrink() 收缩.
+ * 缓冲块按 (dev, sectorno) 散列到 NBUCKET 个桶中, 每个桶一把锁,
+ * 命中时只需要拿对应桶的锁.
+ * 所有缓冲块另外组成一个环, 用 CLOCK 算法选择替换的缓冲块,
+ * 只有未命中时才需要拿 bcache.lock.
+ * 锁的顺序: bcache.lock -> bucket.lock
+ *
+ * bdwrite() 只把缓冲块标记为脏, 由写回线程 bflushd 在脏块过多,
+ * 有进程在等待缓冲块, 或超过 BFLUSH_TICKS 时批量写回.
+ * 脏缓冲块不会被替换或回收.
+ *
+ * bread_async() 提交读请求后立即返回, bwait()/bpoll() 等待或查询完成,
+ * 也可以设置 end_io 在中断中得到通知. bread() 是它的同步包装.
+ * breadahead() 把预读请求放入队列, 由预读线程 breadd 异步读入缓存.
+ * 预读的缓冲块带 ra 标记, 第一次命中时计入 ra_hit,
+ * 没用过就被换出时计入 ra_waste.
+*/
 struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+  struct spinlock lock;       // 保护时钟环, 缓冲块的替换和增长
+  struct kmem_cache cache;
+  struct kmem_cache datacache;  // BSIZE 大小的数据块, 更大的直接按页分配
+  int nbuf;
+  uint64 size;                // 数据占用的字节数
+  int waiters;                // 等待空闲缓冲块的进程数
+  int ndirty;                 // 脏缓冲块数, 原子更新
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
+  // 预读统计, 原子更新
+  uint64 ra_issued;
+  uint64 ra_hit;
+  uint64 ra_waste;
+
+  // 所有缓冲块通过 prev/next 组成的环, hand 为时钟指针
   struct buf head;
+  struct buf *hand;
+
+  struct {
+    struct spinlock lock;
+    struct buf *head;         // 通过 hnext 串起的散列链
+  } bucket[NBUCKET];
 } bcache;
 
+struct {
+  struct spinlock lock;
+  uint head, tail;
+  struct {
+    uint dev;
+    uint sectorno;
+    uint size;
+  } q[RA_QSIZE];
+} raq;
+
+/* slab 构造函数, 缓冲块第一次分配时初始化睡眠锁 */
+static void
+buf_ctor(void *obj)
+{
+  struct buf *b = obj;
+  initsleeplock(&b->lock, "buffer");
+}
+
+/* size 字节的数据占用的页的阶, 一个扇区的用 slab 时返回 -1 */
+static int
+bdata_order(uint size)
+{
+  int order = 0;
+
+  if(size <= BSIZE)
+    return -1;
+  while((PGSIZE << order) < size)
+    order++;
+  return order;
+}
+
+/* size 字节的数据实际占用的内存 */
+static uint64
+bdata_bytes(uint size)
+{
+  int order = bdata_order(size);
+  return order < 0 ? BSIZE : (uint64)PGSIZE << order;
+}
+
+static void *
+bdata_alloc(uint size)
+{
+  int order = bdata_order(size);
+
+  if(order < 0)
+    return kmem_cache_alloc(&bcache.datacache);
+  return kalloc_pages(order);
+}
+
+static void
+bdata_free(void *data, uint size)
+{
+  int order = bdata_order(size);
+
+  if(order < 0)
+    kmem_cache_free(&bcache.datacache, data);
+  else
+    kfree_pages(data, order);
+}
+
+/*
+ * 分配一个 size 字节的缓冲块, 加入时钟环, 不在任何散列链中
+ * 数据量已达上限或内存不足时返回 NULL. 调用者持有 bcache.lock
+*/
+static struct buf*
+bgrow(uint size)
+{
+  struct buf *b;
+
+  if(bcache.size + bdata_bytes(size) > BCACHE_MAX)
+    return NULL;
+  if((b = kmem_cache_alloc(&bcache.cache)) == 0)
+    return NULL;
+  if((b->data = bdata_alloc(size)) == 0){
+    kmem_cache_free(&bcache.cache, b);
+    return NULL;
+  }
+  b->size = size;
+  b->valid = 0;
+  b->refcnt = 0;
+  b->refbit = 0;
+  b->hashed = 0;
+  b->dirty = 0;
+  b->ra = 0;
+  b->disk = 0;
+  b->end_io = 0;
+  b->hnext = 0;
+  b->sectorno = ~0;
+  b->dev = ~0;
+  b->next = &bcache.head;
+  b->prev = bcache.head.prev;
+  bcache.head.prev->next = b;
+  bcache.head.prev = b;
+  bcache.nbuf++;
+  bcache.size += bdata_bytes(size);
+  return b;
+}
+
+/*
+ * 从时钟环中删除缓冲块并释放, 缓冲块不能在散列链中
+ * 调用者持有 bcache.lock
+*/
+static void
+bdestroy(struct buf *b)
+{
+  if(bcache.hand == b)
+    bcache.hand = b->next;
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  bcache.nbuf--;
+  bcache.size -= bdata_bytes(b->size);
+  bdata_free(b->data, b->size);
+  kmem_cache_free(&bcache.cache, b);
+}
+
 /* 
  * * * * * * * * * * * * * * * * * * * * * * 
  * 初始化缓冲区
@@ -30,32 +194,126 @@ struct {
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  initlock(&raq.lock, "raq");
+  kmem_cache_init(&bcache.cache, "buf", sizeof(struct buf), buf_ctor);
+  kmem_cache_init(&bcache.datacache, "bdata", BSIZE, 0);
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
 
-  // Create linked list of buffers
+  // Create ring of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->refcnt = 0;
-    b->sectorno = ~0;
-    b->dev = ~0;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.hand = &bcache.head;
+  acquire(&bcache.lock);
+  for(int i = 0; i < NBUF; i++){
+    if(bgrow(BSIZE) == NULL)
+      panic("binit");
   }
+  release(&bcache.lock);
+  register_shrinker(bshrink);
   /* for test */
   printf("binit\n");
   // printf("%d\n",bread(0,0));
 
 }
 
-// 使用LRU算法, 替换掉最少访问的缓存块
+/* 在桶中查找缓冲块, 调用者持有桶的锁 */
+static struct buf*
+blookup(int h, uint dev, uint sectorno, uint size)
+{
+  struct buf *b;
+
+  for(b = bcache.bucket[h].head; b; b = b->hnext){
+    if(b->dev == dev && b->sectorno == sectorno){
+      if(b->size != size)
+        panic("bget: size mismatch");
+      return b;
+    }
+  }
+  return NULL;
+}
+
+/* 命中时增加引用, 预读的缓冲块第一次命中计入统计. 调用者持有桶的锁 */
+static void
+bhit(struct buf *b)
+{
+  b->refcnt++;
+  if(b->ra){
+    b->ra = 0;
+    __sync_fetch_and_add(&bcache.ra_hit, 1);
+  }
+}
+
+/* 从桶中摘下缓冲块, 调用者持有桶的锁 */
+static void
+bunhash(int h, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bcache.bucket[h].head; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+  b->hnext = 0;
+  b->hashed = 0;
+  if(b->ra){
+    // 预读进来却没有用到
+    b->ra = 0;
+    __sync_fetch_and_add(&bcache.ra_waste, 1);
+  }
+}
+
+/*
+ * CLOCK 算法选择一个未被引用的缓冲块, 最近被访问过(refbit)的缓冲块
+ * 给第二次机会. 选中的缓冲块从散列链中摘下, refcnt 置为1.
+ * 所有缓冲块都被引用时返回 NULL. 调用者持有 bcache.lock
+*/
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+  int h;
+
+  for(int i = 0; i < 2 * bcache.nbuf + 1; i++){
+    b = bcache.hand;
+    bcache.hand = b->next;
+    if(b == &bcache.head)
+      continue;
+
+    if(!b->hashed){
+      // 从未使用过的缓冲块, 其他人找不到它
+      if(b->refcnt == 0){
+        b->refcnt = 1;
+        return b;
+      }
+      continue;
+    }
+
+    // 脏缓冲块要等写回线程写回后才能替换
+    if(b->dirty)
+      continue;
+
+    h = BHASH(b->dev, b->sectorno);
+    acquire(&bcache.bucket[h].lock);
+    if(b->refcnt == 0 && !b->dirty){
+      if(b->refbit){
+        b->refbit = 0;
+      } else {
+        bunhash(h, b);
+        b->refcnt = 1;
+        release(&bcache.bucket[h].lock);
+        return b;
+      }
+    }
+    release(&bcache.bucket[h].lock);
+  }
+  return NULL;
+}
+
 // 寻找一个缓存块给设备号为dev的设备
-// 如果没有找到就分配一个
+// 如果没有找到就用 CLOCK 算法替换一个, 都在使用时增加一个
 // 无论哪种情况,都返回一个locked buffer
 /*
  * * * * * * * * * * * * * * * * * * * * * *
@@ -63,47 +321,108 @@ binit(void)
  * disk_rw 
 */
 static struct buf*
-bget(uint dev, uint sectorno)
+bget(uint dev, uint sectorno, uint size)
 {
   struct buf *b;
+  int h = BHASH(dev, sectorno);
 
-  acquire(&bcache.lock);
+  if(size == 0 || size % BSIZE != 0)
+    panic("bget: size");
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->sectorno == sectorno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleeplock(&b->lock);
-      return b;
-    }
+  acquire(&bcache.bucket[h].lock);
+  if((b = blookup(h, dev, sectorno, size)) != NULL){
+    bhit(b);
+    release(&bcache.bucket[h].lock);
+    acquiresleeplock(&b->lock);
+    return b;
   }
+  release(&bcache.bucket[h].lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    printf("[into bget] \n");
-    printf("b-refcnt = %d \n",b->refcnt);
-    printf("b->dev = %d\n",b->dev);
-    printf("b->sectorno = %d\n",b->sectorno);
-
-    if(b->refcnt != 0) {
-        continue;
-    } else {
-      b->valid = 0;
-      b->dev = dev;
-      b->sectorno = sectorno;
+  // 拿 bcache.lock 后再查一次, 其他进程可能已经读入了同一个扇区
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  if((b = blookup(h, dev, sectorno, size)) != NULL){
+    bhit(b);
+    release(&bcache.bucket[h].lock);
+    release(&bcache.lock);
+    acquiresleeplock(&b->lock);
+    return b;
+  }
+  release(&bcache.bucket[h].lock);
+
+  // 先增长, 达到上限后替换, 都不行就等待有缓冲块被释放
+  // 替换出的缓冲块大小不合适时释放掉, 腾出空间后重新分配
+  bcache.waiters++;
+  for(;;){
+    if((b = bgrow(size)) != NULL){
       b->refcnt = 1;
+      break;
+    }
+    if((b = bvictim()) != NULL){
+      if(b->size == size)
+        break;
+      bdestroy(b);
+      continue;
+    }
+    sleep(&bcache, &bcache.lock);
+
+    // 等待期间其他进程可能已经读入了同一个扇区
+    acquire(&bcache.bucket[h].lock);
+    if((b = blookup(h, dev, sectorno, size)) != NULL){
+      bhit(b);
+      release(&bcache.bucket[h].lock);
+      bcache.waiters--;
       release(&bcache.lock);
       acquiresleeplock(&b->lock);
       return b;
     }
+    release(&bcache.bucket[h].lock);
   }
-  panic("bget: no buffers");
-  /* somthing is wrong */
-  b = NULL;
+  bcache.waiters--;
+  b->valid = 0;
+  b->refbit = 0;
+  b->dev = dev;
+  b->sectorno = sectorno;
+
+  acquire(&bcache.bucket[h].lock);
+  b->hnext = bcache.bucket[h].head;
+  bcache.bucket[h].head = b;
+  b->hashed = 1;
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+
+  acquiresleeplock(&b->lock);
   return b;
 }
+/*
+ * 减少一次引用, touch 表示是否算作一次访问
+ * 持有引用时缓冲块不会被换出, 所在的桶不会变
+*/
+static void
+bput(struct buf *b, int touch)
+{
+  int h = BHASH(b->dev, b->sectorno);
+  int idle;
+
+  acquire(&bcache.bucket[h].lock);
+  b->refcnt--;
+  idle = b->refcnt == 0;
+  if (idle && touch) {
+    // no one is waiting for it.
+    b->refbit = 1;
+  }
+  release(&bcache.bucket[h].lock);
+
+  // 有进程在等待空闲缓冲块. 持有 bcache.lock 再唤醒, 避免丢失唤醒
+  if (idle && bcache.waiters > 0) {
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
+}
+
 /*
  * * * * * * * * * * * * * * * * * * * * * *
  * 释放一个缓冲块
@@ -115,44 +434,447 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleeplock(&b->lock);
+  bput(b, 1);
+}
+
+/*
+ * 内存紧张时由 kalloc 调用, 释放最多 npages 页的未被引用的缓冲块.
+ * 分配内存时可能已经持有 bcache.lock (bgrow), 此时直接放弃.
+ * 返回释放的缓冲块数
+*/
+int
+bshrink(int npages)
+{
+  struct buf *b, *next;
+  int h, n = 0;
+  uint64 freed = 0, want = (uint64)npages * PGSIZE;
+
+  if(holding(&bcache.lock))
+    return 0;
 
   acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
+  for(b = bcache.head.next; b != &bcache.head && freed < want; b = next){
+    next = b->next;
+    if(b->hashed){
+      h = BHASH(b->dev, b->sectorno);
+      acquire(&bcache.bucket[h].lock);
+      if(b->refcnt != 0 || b->dirty){
+        release(&bcache.bucket[h].lock);
+        continue;
+      }
+      bunhash(h, b);
+      release(&bcache.bucket[h].lock);
+    } else if(b->refcnt != 0){
+      continue;
+    }
+    freed += bdata_bytes(b->size);
+    bdestroy(b);
+    n++;
+  }
   release(&bcache.lock);
+
+  // 把空的 slab 页还给页分配器
+  kmem_cache_shrink(&bcache.datacache);
+  kmem_cache_shrink(&bcache.cache);
+  return n;
+}
+
+/*
+ * 读入从 sectorno 开始的 size 字节, 一次查找, 一次磁盘请求
+ * 数据区以簇为单位使用, 元数据以扇区为单位使用.
+ * 读失败时返回的缓冲块 valid 为0, 调用者要检查
+*/
+struct buf*
+bread_size(uint dev, uint sectorno, uint size) {
+  struct buf *b = bread_async(dev, sectorno, size);
+  if (!b->valid)
+    bwait(b);
+
+  return b;
+}
+
+/*
+ * 异步读: 返回加锁的缓冲块, 不在缓存中时向磁盘提交读请求后立即返回,
+ * 使用数据前必须 bwait(). 持有锁的进程才能 bwait() 和 brelse()
+*/
+struct buf*
+bread_async(uint dev, uint sectorno, uint size) {
+  struct buf *b = bget(dev, sectorno, size);
+
+  if (!b->valid && !b->disk)
+    disk_submit(b, 0);
+  return b;
 }
 
+// 等待缓冲块上的I/O完成. Must be locked.
+void
+bwait(struct buf *b) {
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  disk_wait(b);
+  // 写失败时内存中的数据仍然有效
+  if(!b->error)
+    b->valid = 1;
+}
+
+// I/O 已经完成返回1, 不睡眠
+int
+bpoll(struct buf *b) {
+  __sync_synchronize();
+  return b->disk == 0;
+}
+
+// 读一个扇区. 给 FAT 和引导扇区这样的元数据使用, 读不出来无法继续
 struct buf* 
 bread(uint dev, uint sectorno) {
-  struct buf *b;
-  b = NULL;
-  b = bget(dev, sectorno);
-  printf("[into bread] \n");
-  if (!b->valid) {
-    /* for test */
-    printf("[into disk_read] \n");
-    disk_read(b);
-    b->valid = 1;
-  }
+  struct buf *b = bread_size(dev, sectorno, BSIZE);
+
+  if(!b->valid)
+    panic("bread: I/O error");
+  return b;
+}
+
+// 返回内容全为0的缓冲块, 不读磁盘, 给整块覆盖写使用
+struct buf*
+bclear(uint dev, uint sectorno, uint size) {
+  struct buf *b = bget(dev, sectorno, size);
 
+  memset(b->data, 0, size);
+  b->valid = 1;
   return b;
 }
 
+// 写回后清除脏标记
+static void
+bclean(struct buf *b) {
+  if(b->dirty){
+    b->dirty = 0;
+    __sync_fetch_and_sub(&bcache.ndirty, 1);
+  }
+}
+
 // Write b's contents to disk.  Must be locked.
 void 
 bwrite(struct buf *b) {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
   disk_write(b);
+  // 写失败时保留脏标记, 数据不会丢失
+  if(!b->error)
+    bclean(b);
+}
+
+// 标记为脏, 延迟到写回线程写回. Must be locked.
+// 同一个扇区在写回前的多次修改只需要写一次磁盘
+void
+bdwrite(struct buf *b) {
+  if(!holdingsleep(&b->lock))
+    panic("bdwrite");
+  b->valid = 1;
+  if(!b->dirty){
+    b->dirty = 1;
+    __sync_fetch_and_add(&bcache.ndirty, 1);
+  }
+}
+
+/*
+ * 收集最多 BFLUSH_BATCH 个脏缓冲块, 按 (dev, sectorno) 排序后
+ * 依次提交写请求, 全部提交后再等待完成. 正被使用的缓冲块跳过.
+ * 返回写回的个数
+*/
+static int
+bflush(void)
+{
+  struct buf *batch[BFLUSH_BATCH], *b;
+  char sent[BFLUSH_BATCH];
+  int h, i, j, n = 0, nw = 0;
+
+  // 同时持有多个缓冲块的锁, 只能 try: FAT 和目录项的代码会持有一个缓冲块
+  // 再按任意顺序读另一个, 在这里等待会和它们死锁.
+  // 忙的缓冲块跳过, 不占批量的位置, 留到下一轮
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head && n < BFLUSH_BATCH; b = b->next){
+    if(!b->dirty || !tryacquiresleeplock(&b->lock))
+      continue;
+    // 持有引用, 写回期间不会被替换
+    h = BHASH(b->dev, b->sectorno);
+    acquire(&bcache.bucket[h].lock);
+    b->refcnt++;
+    release(&bcache.bucket[h].lock);
+    batch[n++] = b;
+  }
+  release(&bcache.lock);
+
+  // 插入排序, 批量很小
+  for(i = 1; i < n; i++){
+    b = batch[i];
+    for(j = i; j > 0 && (batch[j-1]->dev > b->dev ||
+        (batch[j-1]->dev == b->dev && batch[j-1]->sectorno > b->sectorno)); j--)
+      batch[j] = batch[j-1];
+    batch[j] = b;
+  }
+
+  // 写的过程中持有锁, 数据不会再被修改, 提交时就可以清除脏标记
+  // 磁盘上连续的脏缓冲块合成一个请求
+  disk_plug();
+  for(i = 0; i < n; i = j){
+    struct buf *sg[MAXSEG];
+    int nsg = 0;
+
+    for(j = i; j < n && nsg < MAXSEG; j++){
+      b = batch[j];
+      sent[j] = b->dirty;
+      if(!sent[j])
+        break;
+      if(nsg > 0 && (b->dev != sg[nsg-1]->dev ||
+         b->sectorno != sg[nsg-1]->sectorno + sg[nsg-1]->size / BSIZE))
+        break;
+      bclean(b);
+      sg[nsg++] = b;
+    }
+    if(nsg > 0){
+      disk_submit_sg(sg, nsg, 1);
+      nw += nsg;
+    } else {
+      j++;    // batch[i] 已经不脏了
+    }
+  }
+  disk_unplug();
+
+  for(i = 0; i < n; i++){
+    b = batch[i];
+    if(sent[i]){
+      bwait(b);
+      // 写失败, 数据还在缓冲块中, 重新标记为脏
+      if(b->error){
+        bdwrite(b);
+        nw--;
+      }
+    }
+    releasesleeplock(&b->lock);
+    // 写回不算访问, 不影响替换顺序
+    bput(b, 0);
+  }
+  return nw;
+}
+
+/*
+ * 返回第一个脏缓冲块并持有引用, 没有返回 NULL
+*/
+static struct buf*
+bfirstdirty(void)
+{
+  struct buf *b;
+  int h;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dirty){
+      h = BHASH(b->dev, b->sectorno);
+      acquire(&bcache.bucket[h].lock);
+      b->refcnt++;
+      release(&bcache.bucket[h].lock);
+      release(&bcache.lock);
+      return b;
+    }
+  }
+  release(&bcache.lock);
+  return NULL;
+}
+
+/*
+ * 把所有脏缓冲块写回磁盘, 给 fsync 和卸载文件系统使用.
+ * 内存中的 FAT 表先写到缓冲块. 调用者不能持有缓冲块的锁.
+ * 先批量写回; 剩下的脏块被别人锁着, 一次只等一个, 直到没有脏块.
+ * 有缓冲块写失败时返回 -1
+*/
+int
+bsync(void)
+{
+  struct buf *b;
+  int err;
+
+  fat32_sync();
+  while(bcache.ndirty > 0){
+    if(bflush() > 0)
+      continue;
+    if((b = bfirstdirty()) == NULL)
+      break;
+    acquiresleeplock(&b->lock);
+    err = 0;
+    if(b->dirty){
+      bwrite(b);
+      err = b->error;
+    }
+    releasesleeplock(&b->lock);
+    bput(b, 0);
+    if(err)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * 写回线程. 每个时钟周期醒来检查一次:
+ * 脏块超过 1/4 或有进程等待缓冲块时写回.
+ * 每 BFLUSH_TICKS 无论如何醒来一次, 先把内存中的 FAT 表写到缓冲块,
+ * 这样一直打开的文件对 FAT 的修改也会写回.
+ * 时钟中断在 &ticks 上 wakeup, 这里没有持有时钟的锁,
+ * 丢失一次唤醒只会推迟一个周期
+*/
+static void
+bflushd(void)
+{
+  int last = ticks, stalled = 0;
+
+  for(;;){
+    // 设备中断不派发请求, 没有人等待的异步请求(预读)至少每个周期在这里派发一次
+    disk_kick();
+    acquire(&bcache.lock);
+    // 上一轮一块也没有写出去(都被锁着), 至少等一个周期, 不要空转
+    if(stalled)
+      sleep(&ticks, &bcache.lock);
+    if((bcache.ndirty == 0 ||
+        (bcache.ndirty * 4 < bcache.nbuf && bcache.waiters == 0)) &&
+       ticks - last < BFLUSH_TICKS){
+      sleep(&ticks, &bcache.lock);
+      release(&bcache.lock);
+      stalled = 0;
+      continue;
+    }
+    release(&bcache.lock);
+
+    if(ticks - last >= BFLUSH_TICKS)
+      fat32_sync();
+    stalled = bflush() == 0;
+    last = ticks;
+  }
+}
+
+/*
+ * 预读: 扇区不在缓存中时放入预读队列, 不等待.
+ * 已经在缓存中或放入了队列返回1; 队列满(预读线程跟不上)时丢弃, 返回0,
+ * 调用者以后可以重新预读
+*/
+int
+breadahead(uint dev, uint sectorno, uint size)
+{
+  struct buf *b;
+  int h = BHASH(dev, sectorno);
+  int ok = 0;
+
+  acquire(&bcache.bucket[h].lock);
+  b = blookup(h, dev, sectorno, size);
+  release(&bcache.bucket[h].lock);
+  if(b != NULL)
+    return 1;
+
+  acquire(&raq.lock);
+  if(raq.tail - raq.head < RA_QSIZE){
+    raq.q[raq.tail % RA_QSIZE].dev = dev;
+    raq.q[raq.tail % RA_QSIZE].sectorno = sectorno;
+    raq.q[raq.tail % RA_QSIZE].size = size;
+    raq.tail++;
+    wakeup(&raq);
+    ok = 1;
+  }
+  release(&raq.lock);
+  return ok;
+}
+
+/* 预读完成, 在中断中调用. 缓冲块的锁和引用是 breadd 留下的 */
+static void
+bend_ra(struct buf *b)
+{
+  b->end_io = 0;
+  b->valid = !b->error;
+  b->ra = 1;
+  releasesleeplock(&b->lock);
+  bput(b, 1);
+}
+
+/*
+ * 取出队首的预读请求. prev 不为空时只取紧接在 prev 之后的扇区,
+ * 队列为空或不连续时返回0
+*/
+static int
+raq_pop(struct buf *prev, uint *dev, uint *sectorno, uint *size)
+{
+  int ok = 0;
+
+  acquire(&raq.lock);
+  if(raq.head != raq.tail){
+    *dev = raq.q[raq.head % RA_QSIZE].dev;
+    *sectorno = raq.q[raq.head % RA_QSIZE].sectorno;
+    *size = raq.q[raq.head % RA_QSIZE].size;
+    if(prev == NULL ||
+       (*dev == prev->dev && *sectorno == prev->sectorno + prev->size / BSIZE)){
+      raq.head++;
+      ok = 1;
+    }
+  }
+  release(&raq.lock);
+  return ok;
+}
+
+/*
+ * 预读线程, 提交队列中的请求后不等待完成, 由 bend_ra 释放缓冲块.
+ * 磁盘上连续的簇合成一个请求
+*/
+static void
+breadd(void)
+{
+  struct buf *sg[MAXSEG], *b;
+  uint dev, sectorno, size;
+  int n;
+
+  for(;;){
+    acquire(&raq.lock);
+    while(raq.head == raq.tail)
+      sleep(&raq, &raq.lock);
+    release(&raq.lock);
+
+    n = 0;
+    while(n < MAXSEG && raq_pop(n ? sg[n-1] : NULL, &dev, &sectorno, &size)){
+      b = bget(dev, sectorno, size);
+      if(b->valid){
+        brelse(b);
+        break;
+      }
+      b->end_io = bend_ra;
+      sg[n++] = b;
+    }
+    if(n > 0){
+      __sync_fetch_and_add(&bcache.ra_issued, n);
+      disk_submit_sg(sg, n, 0);
+    }
+  }
+}
+
+// 输出 buffer cache 的使用情况
+void
+bcache_info(void)
+{
+  printf("===================================================\n");
+  printf("bcache: %d bufs, %d KiB, %d dirty\n",
+         bcache.nbuf, (int)(bcache.size / 1024), bcache.ndirty);
+  printf("readahead: issued %d hit %d waste %d\n",
+         (int)bcache.ra_issued, (int)bcache.ra_hit, (int)bcache.ra_waste);
+  printf("===================================================\n");
+}
+
+#ifdef BENCH
+static void bio_bench(void);
+#endif
+
+void
+bthreadinit(void)
+{
+  kthread_create(bflushd, "bflushd");
+  kthread_create(breadd, "breadd");
+#ifdef BENCH
+  kthread_create(bio_bench, "biobench");
+#endif
 }
 
 /*
@@ -160,14 +882,73 @@ bwrite(struct buf *b) {
 */
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->sectorno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
+  bput(b, 1);
+}
+
+#ifdef BENCH
+// 前 BENCH_NSEC 个扇区按扇区缓存, 之后的按簇缓存, 两者不重叠
+#define BENCH_NSEC 1024
+#define BENCH_CLUS (8 * BSIZE)
+
+static void
+bench_report(char *name, int n, uint64 t)
+{
+  t = t ? t : 1;
+  printf("[bench] bcache %s: %d ops, %d ops/s\n", name, n,
+         (int)(n * (uint64)CLOCK_FREQ / t));
+}
+
+// 在内存盘上测 buffer cache 本身的开销, 没有设备延迟.
+// 睡眠锁需要进程上下文, 所以在内核线程中运行
+static void
+bio_bench(void)
+{
+  struct buf *b;
+  uint64 t;
+  uint i, nclus;
+
+  t = r_time();
+  for(i = 0; i < BENCH_NSEC; i++)
+    brelse(bread(RAMDEV, i));
+  bench_report("read miss", BENCH_NSEC, r_time() - t);
+
+  t = r_time();
+  for(i = 0; i < BENCH_NSEC; i++)
+    brelse(bread(RAMDEV, i));
+  bench_report("read hit ", BENCH_NSEC, r_time() - t);
+
+  t = r_time();
+  for(i = 0; i < BENCH_NSEC; i++){
+    b = bread(RAMDEV, i);
+    b->data[0] = i;
+    bdwrite(b);
+    brelse(b);
+  }
+  bsync();
+  bench_report("write+sync", BENCH_NSEC, r_time() - t);
+
+  nclus = (RAMDISK_KB * 1024 / BSIZE - BENCH_NSEC) / (BENCH_CLUS / BSIZE);
+  t = r_time();
+  for(i = 0; i < nclus; i++)
+    brelse(bread_size(RAMDEV, BENCH_NSEC + i * (BENCH_CLUS / BSIZE), BENCH_CLUS));
+  bench_report("read clus", nclus, r_time() - t);
+
+  bcache_info();
+  disk_info();
+  kmem_info();
+  slab_info();
+
   acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  for(;;)
+    sleep(bio_bench, &bcache.lock);
 }
+#endif
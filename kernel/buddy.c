@@ -1,9 +1,61 @@
 #include "types.h"
+#include "param.h"
 #include "buddy.h"
 #include "riscv.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "timer.h"
 #include "defs.h"
 
-struct buddy *freelist[MAX_LEVEL+1];
+// 每一级空闲块组成带头结点的双向循环链表, 由 buddy_lock 保护
+struct buddy freelist[MAX_LEVEL];
+static struct spinlock buddy_lock;
+
+// 每个hart私有的各级空闲块缓存, 只在关中断时由本hart访问, 不需要加锁.
+// 整页的块直接使用 kalloc 的每hart页缓存, 这里只缓存 4~11 级.
+// 缓存为空时从共享的伙伴链表批量取 CACHE_BATCH 块,
+// 超过 CACHE_HIGH 块时批量归还 CACHE_BATCH 块
+#define CACHE_BATCH 8
+#define CACHE_HIGH  (CACHE_BATCH * 4)
+
+static struct {
+  struct buddy *list[MAX_LEVEL];
+  int count[MAX_LEVEL];
+} cache[NCPU];
+
+// 每个物理页一份位图, 记录页内各级块是否空闲(在freelist中)
+// 第lv级在页内有 PGSIZE >> lv 个块, 4~11级共 510 位.
+// 整页分配的页数也记录在页外, 这样整页的分配不需要头部.
+// 这些元数据按需分配: 每 META_PAGES 页一组, 组内有页交给 malloc 时
+// 才用一页存放这一组的元数据, 不用为所有物理页保留
+#define NPAGE       ((PHYSTOP - KERNBASE) / PGSIZE)
+#define MAP_BITS    (2 * PGSIZE >> MIN_LEVEL)
+#define PA2PAGE(pa) (((uint64)(pa) - KERNBASE) >> PGSHIFT)
+#define META_PAGES  32
+
+struct pagemeta {
+  uint64 freemap[META_PAGES][MAP_BITS / 64];
+  uint16 npages[META_PAGES];
+};
+
+static struct pagemeta *meta[(NPAGE + META_PAGES - 1) / META_PAGES];
+
+#define META(pa)    (meta[PA2PAGE(pa) / META_PAGES])
+#define FREEMAP(pa) (META(pa)->freemap[PA2PAGE(pa) % META_PAGES])
+#define NPAGES(pa)  (META(pa)->npages[PA2PAGE(pa) % META_PAGES])
+
+// 保证 pa 所在组的元数据存在, 没有内存时返回0. 调用者持有 buddy_lock
+static int
+_meta_get(void *pa)
+{
+  if(META(pa) == 0)
+  {
+    if((META(pa) = kalloc()) == 0)
+      return 0;
+    memset(META(pa), 0, sizeof(struct pagemeta));
+  }
+  return 1;
+}
 
 // 计算待分配内存对应的块的等级
 static inline int
@@ -20,13 +72,52 @@ _calc_level(size_t size)
   return sz;
 }
 
+// 第lv级的位从 MAP_BITS - (2 * PGSIZE >> lv) 开始
+static inline int
+_bit(struct buddy *block, int lv)
+{
+  uint64 off = (uint64)block & (PGSIZE - 1);
+  return MAP_BITS - (2 * PGSIZE >> lv) + (off >> lv);
+}
+
+static inline int
+_is_free(struct buddy *block, int lv)
+{
+  int bit = _bit(block, lv);
+  return (FREEMAP(block)[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void
+_push(struct buddy *block, int lv)
+{
+  int bit = _bit(block, lv);
+  FREEMAP(block)[bit / 64] |= 1UL << (bit % 64);
+
+  block->next = freelist[lv].next;
+  block->prev = &freelist[lv];
+  freelist[lv].next->prev = block;
+  freelist[lv].next = block;
+}
+
+static inline void
+_remove(struct buddy *block, int lv)
+{
+  int bit = _bit(block, lv);
+  FREEMAP(block)[bit / 64] &= ~(1UL << (bit % 64));
+
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+}
+
 void
 buddyinit()
 {
   int i;
+  initlock(&buddy_lock, "buddy");
   for(i = 0; i < MAX_LEVEL; i++)
   {
-    freelist[i] = 0;
+    freelist[i].next = &freelist[i];
+    freelist[i].prev = &freelist[i];
   }
 }
 
@@ -41,89 +132,208 @@ _get_buddy(struct buddy *block, int lv)
   return (struct buddy *)buddyaddr;
 }
 
-void *
-malloc(size_t sz)
+// 从伙伴链表分配一个lv级的块, 调用者持有 buddy_lock. 没有内存时返回0
+static struct buddy *
+_alloc_block(int lv)
 {
-  sz += 8;        // 作为头部存放level和用于对齐
-
-  int lv = _calc_level(sz);
-
-  int i = lv;
+  int i;
 
   struct buddy *block = 0;
 
-  for(;;i++)
+  for(i = lv; i < MAX_LEVEL; i++)
   {
-    if(freelist[i] != 0)
+    if(freelist[i].next != &freelist[i])
     {
-      block = freelist[i];
-      freelist[i] = freelist[i]->next;
+      block = freelist[i].next;
+      _remove(block, i);
       break;
     }
-
-    if(i > MAX_LEVEL)
-      break;
   }
 
+  // 持有 buddy_lock, kalloc 不会回收内存, 失败时由调用者放开锁后回收
   if(block == 0)
   {
-    block = (struct buddy *)kalloc();
-    if(block == 0)
-      panic("buddy alloc");
+    if((block = (struct buddy *)kalloc()) == 0)
+      return 0;
+    if(!_meta_get(block))
+    {
+      kfree(block);
+      return 0;
+    }
   }
 
-  struct buddy *buddy;
+  // 拆分, 高地址的一半放回低一级的freelist
   for(; i > lv; i--)
+    _push(_get_buddy(block, i - 1), i - 1);
+
+  return block;
+}
+
+// 把一个lv级的块还给伙伴链表, 调用者持有 buddy_lock
+static void
+_free_block(struct buddy *block, int i)
+{
+  struct buddy *buddy;
+
+  // 伙伴空闲则合并, 每一级只需要查一次位图
+  for(; i < MAX_LEVEL; ++i)
   {
-    buddy = _get_buddy(block, i - 1);
-    buddy->next = freelist[i - 1];
-    freelist[i - 1] = buddy;
+    buddy = _get_buddy(block, i);
+    if(!_is_free(buddy, i))
+      break;
+
+    _remove(buddy, i);
+    if(buddy < block)
+      block = buddy;
   }
 
-  // 记录该内存块的level, 给free用
-  uint *b = (uint *)(block);
-  *b = lv;
+  if(i == MAX_LEVEL)
+    kfree(block);
+  else
+    _push(block, i);
+}
+
+// 大于半页的请求直接按页分配, 返回页对齐的地址.
+// 小块分配总带有头部, 不会是页对齐的, free() 据此区分两者
+static void *
+_malloc_pages(size_t sz)
+{
+  int n = PGROUNDUP(sz) / PGSIZE;
+  void *pa;
+  int ok;
 
-  return b + 8;
+retry:
+  if(n == 1)
+    pa = kalloc();
+  else
+    pa = kalloc_run(n);
+
+  if(pa != 0)
+  {
+    acquire(&buddy_lock);
+    ok = _meta_get(pa);
+    release(&buddy_lock);
+    if(ok)
+    {
+      NPAGES(pa) = n;
+      return pa;
+    }
+    if(n == 1)
+      kfree(pa);
+    else
+      kfree_run(pa, n);
+  }
+
+  // 和小块分配一样, 不持有锁时回收内存再重试, 什么也回收不到才放弃
+  if(!kshrink(n))
+    panic("buddy alloc");
+  goto retry;
 }
 
-void
-free(void *pa)
+static void
+_free_pages(void *pa)
 {
-  int i = *((uint *)pa - 8);
+  int n;
 
-  struct buddy *block = (struct buddy *)((uint *)pa - 8);
+  if(META(pa) == 0 || (n = NPAGES(pa)) == 0)
+    panic("free: not allocated");
+  NPAGES(pa) = 0;
 
-  struct buddy *buddy;
-  struct buddy **list;
+  if(n == 1)
+    kfree(pa);
+  else
+    kfree_run(pa, n);
+}
 
-  for(;;++i)
+void *
+malloc(size_t sz)
+{
+  if(sz + BUDDY_HDR > LEVEL_2_SIZE(MAX_LEVEL - 1))
+    return _malloc_pages(sz);
+
+  sz += BUDDY_HDR;        // 作为头部存放level和用于对齐
+
+  int lv = _calc_level(sz);
+
+  struct buddy *block;
+  int i, id;
+
+retry:
+  push_off();
+  id = cpuid();
+
+  // 本地缓存为空, 加锁从伙伴链表批量补充
+  if(cache[id].list[lv] == 0)
   {
-    if(i == MAX_LEVEL)
+    acquire(&buddy_lock);
+    for(i = 0; i < CACHE_BATCH; i++)
     {
-      kfree(pa);
-      break;
+      if((block = _alloc_block(lv)) == 0)
+        break;
+      block->next = cache[id].list[lv];
+      cache[id].list[lv] = block;
     }
+    cache[id].count[lv] += i;
+    release(&buddy_lock);
 
-    buddy = _get_buddy(block, i);
+    // 一块也没有拿到, 放开中断后回收内存再重试
+    if(i == 0)
+    {
+      pop_off();
+      if(!kshrink(1))
+        panic("buddy alloc");
+      goto retry;
+    }
+  }
+
+  block = cache[id].list[lv];
+  cache[id].list[lv] = block->next;
+  cache[id].count[lv]--;
+  pop_off();
+
+  // 记录该内存块的level, 给free用
+  uint64 *b = (uint64 *)block;
+  *b = lv;
 
-    // 判断是否存在和要释放的内存块统一级的freelist
-    list = &freelist[i];
+  return b + 1;
+}
+
+void
+free(void *pa)
+{
+  if(pa == 0)
+    return;
+  if(((uint64)pa & (PGSIZE - 1)) == 0)
+  {
+    _free_pages(pa);
+    return;
+  }
 
-    while((list != 0) && (*list != buddy))
-      list = &(*list)->next;
+  int lv = GET_LEVEL(pa);
 
-    if(*list != buddy)
+  struct buddy *block = (struct buddy *)((uint64 *)pa - 1);
+  int i, id;
+
+  push_off();
+  id = cpuid();
+
+  block->next = cache[id].list[lv];
+  cache[id].list[lv] = block;
+
+  // 本地缓存过多, 加锁批量归还给伙伴链表以便合并
+  if(++cache[id].count[lv] > CACHE_HIGH)
+  {
+    acquire(&buddy_lock);
+    for(i = 0; i < CACHE_BATCH; i++)
     {
-      block->next = freelist[i];
-      freelist[i] = block;
-      return;
-    }
-      else {
-      block = block < buddy ? buddy : block;
-      *list = (*list)->next;
+      block = cache[id].list[lv];
+      cache[id].list[lv] = block->next;
+      _free_block(block, lv);
     }
+    cache[id].count[lv] -= CACHE_BATCH;
+    release(&buddy_lock);
   }
+  pop_off();
 }
 
 // 输出mem info
@@ -131,13 +341,22 @@ void
 mem_info()
 {
   printf("===================================================\n");
+  for(int id = 0; id < NCPU; id++)
+  {
+    printf("hart %d cache:", id);
+    for(int i = MIN_LEVEL; i < MAX_LEVEL; i++)
+      printf(" %d", cache[id].count[i]);
+    printf("\n");
+  }
+
+  acquire(&buddy_lock);
   for(int i = MIN_LEVEL; i  < MAX_LEVEL; i++)
   {
-    struct buddy *block = freelist[i];
+    struct buddy *block = freelist[i].next;
     size_t        sz    = LEVEL_2_SIZE(i);
     printf("level %d size(%d):", i, sz);
 
-    while(block)
+    while(block != &freelist[i])
     {
       printf("%p->%p, ", block, (uint64)block + sz);
       block = block->next;
@@ -145,6 +364,56 @@ mem_info()
 
     printf("\n");
   }
+  release(&buddy_lock);
 
   printf("==================================================\n");
 }
+
+#ifdef BENCH
+#define BENCH_SLOTS 64
+#define BENCH_ITERS 20000
+#define BENCH_MAXSZ LEVEL_2_SIZE(MAX_LEVEL)
+
+// 随机混合 16B ~ 4KiB 的分配和释放, 输出吞吐量
+void
+buddy_bench()
+{
+  void *slot[BENCH_SLOTS];
+  uint64 seed = 12345;
+  uint64 t, talloc = 0, tfree = 0;
+  int nalloc = 0, nfree = 0;
+  int i, k;
+
+  memset(slot, 0, sizeof(slot));
+  for(i = 0; i < BENCH_ITERS; i++)
+  {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    k = (seed >> 33) % BENCH_SLOTS;
+    if(slot[k])
+    {
+      t = r_time();
+      free(slot[k]);
+      tfree += r_time() - t;
+      slot[k] = 0;
+      nfree++;
+    } else {
+      size_t sz = 16 + (seed >> 17) % (BENCH_MAXSZ - 16 + 1);
+      t = r_time();
+      slot[k] = malloc(sz);
+      talloc += r_time() - t;
+      nalloc++;
+    }
+  }
+  for(k = 0; k < BENCH_SLOTS; k++)
+    if(slot[k])
+      free(slot[k]);
+
+  // 避免除零
+  talloc = talloc ? talloc : 1;
+  tfree = tfree ? tfree : 1;
+  printf("[bench] buddy malloc: %d ops, %d ops/s\n", nalloc,
+         (int)(nalloc * (uint64)CLOCK_FREQ / talloc));
+  printf("[bench] buddy free:   %d ops, %d ops/s\n", nfree,
+         (int)(nfree * (uint64)CLOCK_FREQ / tfree));
+}
+#endif
@@ -10,21 +10,256 @@
 #include "sleeplock.h"
 #include "buf.h"
 #include "virtio.h"
+#include "blkdev.h"
+#include "timer.h"
 #include "defs.h"
 
 
+/*
+ * I/O 调度: 提交的请求先按扇区有序地放入设备的读, 写两个队列,
+ * 设备中的请求数不超过 depth 时才派发, 派发时把扇区连续的
+ * 请求合成一个 scatter-gather 请求. 平时读优先, 按单向电梯的顺序派发,
+ * 写最多连续被跳过 WRITE_STARVE 次; 超过期限的请求先派发.
+*/
+#define READ_EXPIRE  (CLOCK_FREQ / 20)  /* 读最多等 50ms */
+#define WRITE_EXPIRE (CLOCK_FREQ / 2)   /* 写最多等 500ms */
+#define WRITE_STARVE 2
+
+static struct blkdev blkdevs[NBLKDEV];
+
+static struct blkdev_ops virtio_ops = {
+    .submit   = virtio_submit_sg,
+    .wait     = virtio_wait,
+    .inflight = virtio_inflight,
+    .plug     = virtio_plug,
+    .unplug   = virtio_unplug,
+    .info     = virtio_info,
+};
+
+/* 注册一个块设备, depth 为同时交给设备的请求数上限 */
+void blkdev_register(int dev, char *name, struct blkdev_ops *ops, uint64 nsec, int depth)
+{
+    struct blkdev *bd;
+
+    if (dev < 0 || dev >= NBLKDEV || blkdevs[dev].ops)
+        panic("blkdev_register");
+    bd = &blkdevs[dev];
+    strncpy(bd->name, name, sizeof(bd->name) - 1);
+    initlock(&bd->lock, "iosched");
+    bd->nsec = nsec;
+    bd->depth = depth;
+    bd->ops = ops;
+    printf("blkdev %d: %s, %d sectors\n", dev, name, (int)nsec);
+}
+
+struct blkdev *blkdev_get(int dev)
+{
+    if (dev < 0 || dev >= NBLKDEV || blkdevs[dev].ops == 0)
+        panic("blkdev_get: no such device");
+    return &blkdevs[dev];
+}
+
+static inline int
+adjacent(struct buf *a, struct buf *b)
+{
+    return a->sectorno + a->size / BSIZE == b->sectorno;
+}
+
+/* 有序地插入队列 */
+static void
+enqueue(struct buf **q, struct buf *b)
+{
+    while (*q && (*q)->sectorno < b->sectorno)
+        q = &(*q)->qnext;
+    b->qnext = *q;
+    *q = b;
+}
+
+/* 返回队列中已经超过期限的最早的请求的链接, 没有返回0 */
+static struct buf **
+expired(struct buf **q, uint64 now)
+{
+    struct buf **old = 0;
+
+    for (; *q; q = &(*q)->qnext)
+        if (old == 0 || (*q)->qdeadline < (*old)->qdeadline)
+            old = q;
+    if (old && (*old)->qdeadline <= now)
+        return old;
+    return 0;
+}
+
+/* 单向电梯: 扇区不小于 pos 的第一个请求, 没有就回到队首 */
+static struct buf **
+elevator(struct buf **q, uint pos)
+{
+    struct buf **pp;
+
+    for (pp = q; *pp; pp = &(*pp)->qnext)
+        if ((*pp)->sectorno >= pos)
+            return pp;
+    return q;
+}
+
+/* 选出下一个要派发的请求. 调用者持有 bd->lock, 队列不为空 */
+static struct buf **
+pick(struct blkdev *bd, int *write)
+{
+    uint64 now = r_time();
+    struct buf **pp;
+
+    if ((pp = expired(&bd->rq, now)) != 0) {
+        *write = 0;
+    } else if ((pp = expired(&bd->wq, now)) != 0) {
+        *write = 1;
+    } else if (bd->rq && (bd->wq == 0 || bd->starved < WRITE_STARVE)) {
+        *write = 0;
+        pp = elevator(&bd->rq, bd->pos);
+    } else {
+        *write = 1;
+        pp = elevator(&bd->wq, bd->pos);
+    }
+
+    if (*write)
+        bd->starved = 0;
+    else if (bd->wq)
+        bd->starved++;
+    return pp;
+}
+
+/* 设备有空位时派发队列中的请求 */
+static void
+dispatch(struct blkdev *bd)
+{
+    struct buf *sg[MAXSEG], **pp;
+    int n, write;
+
+    acquire(&bd->lock);
+    while (!bd->plugged && (bd->rq || bd->wq)
+           && bd->ops->inflight() + bd->busy < bd->depth) {
+        pp = pick(bd, &write);
+        // 摘下从 pp 开始扇区连续的一串
+        n = 0;
+        while (*pp && n < MAXSEG && (n == 0 || adjacent(sg[n-1], *pp))) {
+            sg[n++] = *pp;
+            *pp = (*pp)->qnext;
+        }
+        bd->nmerge += n - 1;
+        bd->pos = sg[n-1]->sectorno + sg[n-1]->size / BSIZE;
+        bd->busy++;
+        release(&bd->lock);
+
+        bd->ops->submit(sg, n, write);
+
+        acquire(&bd->lock);
+        bd->busy--;
+    }
+    release(&bd->lock);
+}
+
 void disk_init(void)
 {
     devinit();
+    blkdev_register(ROOTDEV, "virtio", &virtio_ops, virtio_capacity(), virtio_depth());
+}
+
+/*
+ * 提交请求后立即返回, 完成后 b->disk 清零并调用 b->end_io.
+ * 超出设备容量的请求不交给设备, 设置 b->error 后当作已完成, 返回-1
+*/
+int disk_submit(struct buf *b, int write)
+{
+    struct blkdev *bd = blkdev_get(b->dev);
+
+    b->error = 0;
+    if (b->sectorno + b->size / BSIZE > bd->nsec) {
+        printf("disk_submit: dev %d sector %d out of range\n", b->dev, b->sectorno);
+        b->error = 1;
+        b->disk = 0;
+        if (b->end_io)
+            b->end_io(b);
+        return -1;
+    }
+    acquire(&bd->lock);
+    b->disk = 1;
+    b->qdeadline = r_time() + (write ? WRITE_EXPIRE : READ_EXPIRE);
+    enqueue(write ? &bd->wq : &bd->rq, b);
+    release(&bd->lock);
+    dispatch(bd);
+    return 0;
+}
+/* 扇区连续的多个缓冲块, 由调度器合并 */
+void disk_submit_sg(struct buf **bufs, int n, int write)
+{
+    disk_plug();
+    for (int i = 0; i < n; i++)
+        disk_submit(bufs[i], write);
+    disk_unplug();
 }
+void disk_wait(struct buf *b)
+{
+    blkdev_get(b->dev)->ops->wait(b);
+}
+
 void disk_read(struct buf *b)
 {
-    
-	Virtioread(b,b->sectorno);
+    disk_submit(b, 0);
+    disk_wait(b);
 }
 void disk_write(struct buf *b)
 {
-	Virtiowrite(b, b->sectorno);
+    disk_submit(b, 1);
+    disk_wait(b);
+}
+
+/* plug 和 unplug 之间提交的请求先在队列中排序合并, unplug 时一起派发 */
+void disk_plug(void)
+{
+    for (int i = 0; i < NBLKDEV; i++) {
+        if (blkdevs[i].ops == 0)
+            continue;
+        acquire(&blkdevs[i].lock);
+        blkdevs[i].plugged++;
+        release(&blkdevs[i].lock);
+    }
+}
+void disk_unplug(void)
+{
+    struct blkdev *bd;
+
+    for (bd = blkdevs; bd < &blkdevs[NBLKDEV]; bd++) {
+        if (bd->ops == 0)
+            continue;
+        acquire(&bd->lock);
+        bd->plugged--;
+        release(&bd->lock);
+        // 一批请求只通知设备一次
+        if (bd->ops->plug)
+            bd->ops->plug();
+        dispatch(bd);
+        if (bd->ops->unplug)
+            bd->ops->unplug();
+    }
+}
+
+/* 设备完成请求后在进程上下文中调用, 派发可能睡眠, 不能在中断中调用 */
+void disk_kick(void)
+{
+    for (int i = 0; i < NBLKDEV; i++)
+        if (blkdevs[i].ops)
+            dispatch(&blkdevs[i]);
+}
+
+void disk_info(void)
+{
+    for (int i = 0; i < NBLKDEV; i++) {
+        if (blkdevs[i].ops == 0)
+            continue;
+        printf("blkdev %d %s: %d requests merged\n", i, blkdevs[i].name,
+               (int)blkdevs[i].nmerge);
+        if (blkdevs[i].ops->info)
+            blkdevs[i].ops->info();
+    }
 }
 
 void disk_intr(void)
@@ -16,6 +16,8 @@
 #include "proc.h"
 #include "buf.h"
 #include "fat32.h"
+#include "slab.h"
+#include "buddy.h"
 #include "defs.h"
 #include "stat.h"
 
@@ -58,6 +60,7 @@ union dentry
 };
 
 static struct {
+    uint dev;               /* 所在的块设备 */
     uint32 first_data_sec;
     uint32 data_sec_cnt;
     uint32 data_clus_cnt;
@@ -76,13 +79,82 @@ static struct {
 
 }fat;
 
+/*
+ * 空闲簇位图, 挂载时扫描一遍 FAT 建立, 之后由 alloc_clus/free_clus 维护.
+ * 位为1表示簇已使用, 簇0和簇1不是数据簇, 始终为1.
+ * 分配从 hint 开始按字查找, 连续分配时均摊 O(1)
+*/
+static struct {
+    struct spinlock lock;
+    uint64 *bits;
+    uint32 nfree;           /* 空闲簇数 */
+    uint32 hint;            /* 下一次从这里开始找 */
+}fmap;
+
+static void fmap_init(void);
+
+/*
+ * 内存中的 FAT 表(FATCACHE 打开时)
+ * 按页装入, 第一次访问某页时才从第一个 FAT 读入, 之后 read_fat/write_fat
+ * 只是数组读写. 修改过的页由 fat32_sync() 写到每一个 FAT 副本.
+ * 最多装入 FATCACHE_MAX 页, 超过时和内存紧张时按时钟顺序丢弃干净的页.
+ * 没有内存装入时 read_fat/write_fat 直接读写缓冲块中的 FAT
+*/
+#define FC_PERPG (PGSIZE / sizeof(uint32))  /* 每页的表项数 */
+#define FC_DIRTY 1  /* 修改过, 还没有写到缓冲块 */
+#define FC_BUSY  2  /* fat32_sync 正在复制, 不能丢弃 */
+
+static struct {
+    int on;
+    struct spinlock lock;   /* 保护页表, 表项的读写和标记 */
+    uint32 **page;
+    uchar *flags;
+    uint32 npage;
+    uint32 nload;           /* 装入的页数 */
+    uint32 hand;            /* 丢弃时的时钟指针 */
+}fcache;
+
+static void fcache_init(void);
+
+/* 目录项缓存, 目录项从 slab 中分配, 不够时可以增长 */
 static struct entry_cache{
     struct spinlock lock;
-    struct dirent entries[ENTRY_CACHE_NUM];
+    struct kmem_cache cache;
+    int nentry;             /* 已分配的目录项个数 */
 }ecache;
 
 static struct dirent root;
 
+/*
+ * 目录项散列表, 按 (父目录 id, 文件名) 散列, 每个桶一把锁.
+ * 每个桶另外记录最近 ENEG_NUM 个查找失败的文件名(负缓存),
+ * 反复查找不存在的路径时不用再读目录. 在目录中创建文件时删除对应的负缓存,
+ * 父目录的目录项被重新使用时 id 改变, 旧的负缓存自然失效.
+ *
+ * 引用计数 ref 原子更新, 命中时只需要桶的锁; ecache.lock 只保护 LRU 链表,
+ * 目录项的替换和 id 的分配. 散列表中的目录项只在持有桶的锁时
+ * 从 ref 0 变为非0, 所以替换时在桶的锁下确认 ref 仍为0.
+ * 锁的顺序: ecache.lock -> bucket.lock
+*/
+#define EHASH_NBUCKET 31
+#define ENEG_NUM 4
+#define EHASH(pid, hash) (((pid) * 31 + (hash)) % EHASH_NBUCKET)
+
+struct eneg {
+    uint32 pid;             /* 0 表示空 */
+    uint32 hash;
+    char name[FAT32_MAX_FILENAME + 1];
+};
+
+static struct {
+    struct spinlock lock;
+    struct dirent *head;
+    struct eneg neg[ENEG_NUM];
+    int negnext;            /* 负缓存满时轮流替换 */
+}ehash[EHASH_NBUCKET];
+
+static uint32 enextid = 1;  /* 由 ecache.lock 保护 */
+
 /*
  * * * * * * * * * * * * * * * * * * * * * * * * *
  * 初始化数据 
@@ -92,11 +164,19 @@ static struct dirent root;
  *          -1   fail 
 */
 
+/* slab 构造函数, 目录项第一次分配时初始化睡眠锁 */
+static void dirent_ctor(void *obj)
+{
+    struct dirent *de = obj;
+    initsleeplock(&de->lock, "entry");
+}
+
 int fat32_init(){
     /* for test */
     printf("[fat32_init] enter\n");
 
-    struct buf* b = bread(0, 0); /* 设备号与扇区号 */
+    fat.dev = ROOTDEV;
+    struct buf* b = bread(fat.dev, 0); /* 设备号与扇区号 */
     /* 检查扇区数据中的特定标识 FAT32 */
     printf("read is ok!\n");
     if (strncmp((char const*)(b->data + 82),"FAT32",5))
@@ -126,28 +206,25 @@ int fat32_init(){
     /* 检查 BSIZE */ 
     if (BSIZE != fat.bpb.byts_per_sec) 
         panic("byts_per_sec != BSIZE");
+    fcache_init();
+    fmap_init();
     initlock(&ecache.lock, "ecache");
+    kmem_cache_init(&ecache.cache, "dirent", sizeof(struct dirent), dirent_ctor);
+    ecache.nentry = 0;
+    for (int i = 0; i < EHASH_NBUCKET; i++) {
+        initlock(&ehash[i].lock, "ehash");
+    }
     /* 初始化根目录 */
     memset(&root, 0, sizeof(root));
     initsleeplock(&root.lock, "entry");
+    root.dev = fat.dev;
+    root.id = enextid++;
     root.attribute = (ATTR_DIRECTORY | ATTR_SYSTEM);
     root.first_clus = root.cur_clus = fat.bpb.root_clus;
     root.valid = 1;
     root.prev = &root;
     root.next = &root;
-    /* 初始化目录缓存 ecache */
-    for(struct dirent *de = ecache.entries; de < ecache.entries + ENTRY_CACHE_NUM; de++) {
-        de->dev = 0;
-        de->valid = 0;
-        de->ref = 0;
-        de->dirty = 0;
-        de->parent = 0;
-        de->next = root.next;
-        de->prev = &root;
-        initsleeplock(&de->lock, "entry");
-        root.next->prev = de;
-        root.next = de;
-    }
+    /* 目录缓存 ecache 在 eget() 中按需增长 */
     return 0;
 
 }
@@ -184,6 +261,173 @@ static inline uint32 fat_sec_of_clus(uint32 cluster, uchar fat_num) {
 static inline uint32 fat_offset_of_clus(uint32 cluster) {
     return (cluster << 2) % fat.bpb.byts_per_sec;
 }
+/*
+ * * * * * * * * * * * * * * * * * * * * * * * * *
+ * 内存中的 FAT 表
+*/
+static int fcache_shrink(int npages);
+
+static void fcache_init(void)
+{
+    fcache.on = FATCACHE;
+    if (!fcache.on) {
+        return;
+    }
+    initlock(&fcache.lock, "fcache");
+    fcache.npage = (fat.bpb.fat_sz * fat.bpb.byts_per_sec + PGSIZE - 1) / PGSIZE;
+    fcache.page = malloc(fcache.npage * sizeof(uint32 *));
+    fcache.flags = malloc(fcache.npage);
+    memset(fcache.page, 0, fcache.npage * sizeof(uint32 *));
+    memset(fcache.flags, 0, fcache.npage);
+    fcache.nload = 0;
+    fcache.hand = 0;
+    register_shrinker(fcache_shrink);
+}
+
+/* 丢弃最多 n 个干净的页, 返回丢弃的页数. 调用者持有 fcache.lock */
+static int fcache_evict(int n)
+{
+    int freed = 0;
+
+    for (uint32 k = 0; k < fcache.npage && freed < n; k++) {
+        uint32 i = fcache.hand;
+        fcache.hand = (fcache.hand + 1) % fcache.npage;
+        if (fcache.page[i] == 0 || fcache.flags[i] != 0) {
+            continue;
+        }
+        kfree(fcache.page[i]);
+        fcache.page[i] = 0;
+        fcache.nload--;
+        freed++;
+    }
+    return freed;
+}
+
+/* 内存紧张时由 kalloc 调用, 只丢弃干净的页 */
+static int fcache_shrink(int npages)
+{
+    int n;
+
+    if (holding(&fcache.lock)) {
+        return 0;
+    }
+    acquire(&fcache.lock);
+    n = fcache_evict(npages);
+    release(&fcache.lock);
+    return n;
+}
+
+/* 从第一个 FAT 读入第 i 页, 没有内存时返回0 */
+static int fcache_load(uint32 i)
+{
+    uint32 const sec_per_pg = PGSIZE / fat.bpb.byts_per_sec;
+    uint32 *pg;
+    struct buf *b;
+
+    if ((pg = kalloc()) == 0) {
+        return 0;
+    }
+    for (uint32 j = 0, sec = i * sec_per_pg; j < sec_per_pg && sec < fat.bpb.fat_sz; j++, sec++) {
+        b = bread(fat.dev, fat.bpb.rsvd_sec_cnt + sec);
+        memmove((char *)pg + j * fat.bpb.byts_per_sec, b->data, fat.bpb.byts_per_sec);
+        brelse(b);
+    }
+    // 读盘时可能有别的进程装入了同一页
+    acquire(&fcache.lock);
+    if (fcache.page[i] == 0) {
+        if (fcache.nload >= FATCACHE_MAX) {
+            fcache_evict(1);
+        }
+        fcache.page[i] = pg;
+        fcache.nload++;
+        pg = 0;
+    }
+    release(&fcache.lock);
+    if (pg) {
+        kfree(pg);
+    }
+    return 1;
+}
+
+/* 读 cluster 的表项, 所在的页不在内存中时先读入. 没有内存时返回0 */
+static int fcache_get(uint32 cluster, uint32 *val)
+{
+    uint32 i = cluster / FC_PERPG;
+
+    for (;;) {
+        acquire(&fcache.lock);
+        if (fcache.page[i]) {
+            *val = fcache.page[i][cluster % FC_PERPG];
+            release(&fcache.lock);
+            return 1;
+        }
+        release(&fcache.lock);
+        if (!fcache_load(i)) {
+            return 0;
+        }
+    }
+}
+
+/* 写 cluster 的表项并标记为脏. 没有内存时返回0 */
+static int fcache_set(uint32 cluster, uint32 val)
+{
+    uint32 i = cluster / FC_PERPG;
+
+    for (;;) {
+        acquire(&fcache.lock);
+        if (fcache.page[i]) {
+            fcache.page[i][cluster % FC_PERPG] = val;
+            fcache.flags[i] |= FC_DIRTY;
+            release(&fcache.lock);
+            return 1;
+        }
+        release(&fcache.lock);
+        if (!fcache_load(i)) {
+            return 0;
+        }
+    }
+}
+
+/*
+ * 把修改过的 FAT 页写到每一个 FAT 副本的缓冲块中, 由写回线程写盘.
+ * 先清除脏标记再复制, 复制期间的修改会让这一页重新变脏.
+ * 复制期间页带 FC_BUSY 标记, 不会被丢弃
+ */
+void fat32_sync(void)
+{
+    uint32 const sec_per_pg = PGSIZE / fat.bpb.byts_per_sec;
+    struct buf *b;
+
+    if (!fcache.on) {
+        return;
+    }
+    for (uint32 i = 0; i < fcache.npage; i++) {
+        acquire(&fcache.lock);
+        int dirty = (fcache.flags[i] & (FC_DIRTY | FC_BUSY)) == FC_DIRTY;
+        if (dirty) {
+            fcache.flags[i] = FC_BUSY;
+        }
+        release(&fcache.lock);
+        if (!dirty) {
+            continue;
+        }
+        for (uint32 k = 0; k < fat.bpb.fat_cnt; k++) {
+            for (uint32 j = 0, sec = i * sec_per_pg; j < sec_per_pg && sec < fat.bpb.fat_sz; j++, sec++) {
+                // 整个扇区都会被覆盖, 不需要先读盘
+                b = bclear(fat.dev, fat.bpb.rsvd_sec_cnt + k * fat.bpb.fat_sz + sec, BSIZE);
+                acquire(&fcache.lock);
+                memmove(b->data, (char *)fcache.page[i] + j * fat.bpb.byts_per_sec, fat.bpb.byts_per_sec);
+                release(&fcache.lock);
+                bdwrite(b);
+                brelse(b);
+            }
+        }
+        acquire(&fcache.lock);
+        fcache.flags[i] &= ~FC_BUSY;
+        release(&fcache.lock);
+    }
+}
+
 /**
  * * * * * * * * * * * * * * * * * * * * * * * * *
  * fat 表的读写 
@@ -201,10 +445,14 @@ static uint32 read_fat(uint32 cluster)
     if (cluster > fat.data_clus_cnt + 1) {     // 簇号从2开始，而不是从0，因此此处比较的是是否超出有效簇号范围
         return 0;
     }
+    uint32 next_clus;
+    if (fcache.on && fcache_get(cluster, &next_clus)) {
+        return next_clus;
+    }
     uint32 fat_sec = fat_sec_of_clus(cluster, 1); // 计算指定簇对应的FAT扇区
 
-    struct buf *b = bread(0, fat_sec); // 从磁盘读取相应的FAT扇区
-    uint32 next_clus = *(uint32 *)(b->data + fat_offset_of_clus(cluster)); // 从读取的扇区中获取下一个簇的号码
+    struct buf *b = bread(fat.dev, fat_sec); // 从磁盘读取相应的FAT扇区
+    next_clus = *(uint32 *)(b->data + fat_offset_of_clus(cluster)); // 从读取的扇区中获取下一个簇的号码
     brelse(b); // 释放读取的扇区
     return next_clus;
 }
@@ -220,18 +468,20 @@ static int write_fat(uint32 cluster, uint32 content)
     if (cluster > fat.data_clus_cnt + 1) {
         return -1;
     }
-    // 计算对应簇号的FAT扇区
-    uint32 fat_sec = fat_sec_of_clus(cluster, 1);
-    // 读取该扇区到缓冲区
-    struct buf *b = bread(0, fat_sec);
-    // 计算在缓冲区中的偏移量
-    uint off = fat_offset_of_clus(cluster);
-    // 更新FAT表项
-    *(uint32 *)(b->data + off) = content;
-    // 写回修改后的缓冲区
-    bwrite(b);
-    // 释放缓冲区
-    brelse(b);
+    if (fcache.on && fcache_set(cluster, content)) {
+        return 0;
+    }
+    // 每一个 FAT 副本都要更新
+    for (uchar k = 1; k <= fat.bpb.fat_cnt; k++) {
+        // 读取对应簇号的FAT扇区到缓冲区
+        struct buf *b = bread(fat.dev, fat_sec_of_clus(cluster, k));
+        // 更新FAT表项
+        *(uint32 *)(b->data + fat_offset_of_clus(cluster)) = content;
+        // 标记为脏, 由写回线程统一写回
+        bdwrite(b);
+        // 释放缓冲区
+        brelse(b);
+    }
     return 0;
 }
 /*
@@ -242,47 +492,179 @@ static int write_fat(uint32 cluster, uint32 content)
  /* 参数：  cluster - 指定要零化的簇的编号 */
 static void zero_clus(uint32 cluster)
 {
-    // 计算簇起始扇区
-    uint32 sec = first_sec_of_clus(cluster);
+    // 整簇清零, 不需要先读磁盘
+    struct buf *b = bclear(fat.dev, first_sec_of_clus(cluster), fat.byts_per_clus);
+    bdwrite(b); // 延迟写回
+    brelse(b); // 释放缓冲区
+}
+
+
+/*
+ * 空闲簇位图
+*/
+#define FMAP_WORDS ((fat.data_clus_cnt + 2 + 63) / 64)
+
+static inline void fmap_set(uint32 clus)
+{
+    fmap.bits[clus / 64] |= 1UL << (clus % 64);
+}
+
+static inline void fmap_clear(uint32 clus)
+{
+    fmap.bits[clus / 64] &= ~(1UL << (clus % 64));
+}
+
+/* 扫描 FAT 建立位图, 每个 FAT 扇区只读一次 */
+static void fmap_init(void)
+{
+    uint32 const ent_per_sec = fat.bpb.byts_per_sec / sizeof(uint32);
+    uint32 nclus = fat.data_clus_cnt + 2;
+    uint32 clus = 0;
     struct buf *b;
-    // 遍历簇中的所有扇区，将其数据区域清零
-    for (int i = 0; i < fat.bpb.sec_per_clus; i++) {
-        b = bread(0, sec++); // 读取扇区
-        memset(b->data, 0, BSIZE); // 清零扇区数据
-        bwrite(b); // 写回扇区
-        brelse(b); // 释放缓冲区
+
+    initlock(&fmap.lock, "fmap");
+    fmap.bits = malloc(FMAP_WORDS * sizeof(uint64));
+    // 末尾多出的位当作已使用, 查找时不会越界
+    memset(fmap.bits, 0xff, FMAP_WORDS * sizeof(uint64));
+    fmap.nfree = 0;
+    // 直接流过缓冲块, 不装入 FAT 缓存
+    for (uint32 sec = fat.bpb.rsvd_sec_cnt; clus < nclus; sec++) {
+        b = bread(fat.dev, sec);
+        for (uint32 j = 0; j < ent_per_sec && clus < nclus; j++, clus++) {
+            if (clus >= 2 && ((uint32 *)(b->data))[j] == 0) {
+                fmap_clear(clus);
+                fmap.nfree++;
+            }
+        }
+        brelse(b);
     }
+    fmap.hint = 2;
+    printf("[FAT32 init]free clusters: %d/%d\n", fmap.nfree, fat.data_clus_cnt);
 }
 
+static inline int fmap_test(uint32 clus)
+{
+    return (fmap.bits[clus / 64] >> (clus % 64)) & 1;
+}
 
- /* 分配一个空簇
- * 参数：  dev - 设备编号
- * 返回值：  分配到的簇的编号 */
-static uint32 alloc_clus(uchar dev)
+/* 从 hint 开始找第一个空闲簇. 调用者持有 fmap.lock, 且 nfree > 0 */
+static uint32 fmap_find(void)
+{
+    uint32 nword = FMAP_WORDS;
+    uint32 w = fmap.hint / 64;
+
+    for (uint32 i = 0; i <= nword; i++, w = (w + 1) % nword) {
+        uint64 word = fmap.bits[w];
+        // hint 所在的字先跳过 hint 之前的位, 绕回来时再看
+        if (i == 0)
+            word |= (1UL << (fmap.hint % 64)) - 1;
+        if (word != ~0UL)
+            return w * 64 + __builtin_ctzl(~word);
+    }
+    panic("fmap_find");
+    return 0;
+}
+
+/*
+ * 分配最多 want 个连续的空闲簇并标记为已使用, 返回首簇, 个数放在 *got.
+ * goal 空闲时从 goal 开始(接在文件末尾), 否则从 hint 开始找. 没有空闲簇返回0
+ */
+static uint32 fmap_alloc(uint32 goal, uint32 want, uint32 *got)
+{
+    uint32 end = fat.data_clus_cnt + 2;
+    uint32 start, n;
+
+    acquire(&fmap.lock);
+    if (fmap.nfree == 0) {
+        release(&fmap.lock);
+        *got = 0;
+        return 0;
+    }
+    if (goal >= 2 && goal < end && !fmap_test(goal))
+        start = goal;
+    else
+        start = fmap_find();
+    for (n = 0; n < want && start + n < end && !fmap_test(start + n); n++)
+        fmap_set(start + n);
+    fmap.nfree -= n;
+    fmap.hint = start + n < end ? start + n : 2;
+    release(&fmap.lock);
+    *got = n;
+    return start;
+}
+
+static void fmap_free(uint32 clus)
+{
+    acquire(&fmap.lock);
+    fmap_clear(clus);
+    fmap.nfree++;
+    release(&fmap.lock);
+}
+
+/* 不读磁盘的空间统计: 簇大小, 数据簇总数, 空闲簇数 */
+void fat32_statfs(uint *clus_size, uint *nclus, uint *nfree)
+{
+    *clus_size = fat.byts_per_clus;
+    *nclus = fat.data_clus_cnt;
+    *nfree = fmap.nfree;
+}
+
+/*
+ * 把 start 开始的 n 个连续簇链接起来, 最后一个标记为链尾.
+ * 同一个 FAT 扇区中的表项只读写一次缓冲块
+ */
+static void link_run(uint32 start, uint32 n)
 {
-    // 从FAT中查找第一个空闲簇
-    struct buf *b;
-    uint32 sec = fat.bpb.rsvd_sec_cnt;
     uint32 const ent_per_sec = fat.bpb.byts_per_sec / sizeof(uint32);
-    for (uint32 i = 0; i < fat.bpb.fat_sz; i++, sec++) {
-        b = bread(dev, sec); // 读取FAT扇区
-        for (uint32 j = 0; j < ent_per_sec; j++) {
-            // 查找未使用的簇
-            if (((uint32 *)(b->data))[j] == 0) {
-                // 标记簇为已使用
-                ((uint32 *)(b->data))[j] = FAT32_EOC + 7;
-                bwrite(b); // 写回FAT
-                brelse(b); // 释放缓冲区
-                uint32 clus = i * ent_per_sec + j;
-                zero_clus(clus); // 零化新分配的簇
-                return clus; // 返回簇号
-            }
+    uint32 clus, end = start + n;
+    struct buf *b;
+
+    if (fcache.on) {
+        for (clus = start; clus < end; clus++) {
+            write_fat(clus, clus + 1 < end ? clus + 1 : FAT32_EOC + 7);
+        }
+        return;
+    }
+    for (uchar k = 1; k <= fat.bpb.fat_cnt; k++) {
+        for (clus = start; clus < end; ) {
+            b = bread(fat.dev, fat_sec_of_clus(clus, k));
+            do {
+                ((uint32 *)(b->data))[clus % ent_per_sec] = clus + 1 < end ? clus + 1 : FAT32_EOC + 7;
+                clus++;
+            } while (clus < end && clus % ent_per_sec != 0);
+            bdwrite(b);
+            brelse(b);
         }
-        brelse(b); // 释放缓冲区
     }
-    // 如果没有找到空闲簇，则抛出异常
-    panic("no clusters");
-    return NULL;
+}
+
+/*
+ * 分配最多 want 个连续的簇, 接在 prev 之后(prev 为0时是新链),
+ * 尽量紧跟着 prev, 使文件在磁盘上连续. 返回首簇, 个数放在 *got.
+ * 没有空闲簇时返回0
+ */
+static uint32 alloc_run(uint32 prev, uint32 want, uint32 *got)
+{
+    uint32 start = fmap_alloc(prev ? prev + 1 : 0, want, got);
+    if (start == 0)
+        return 0;
+    // 标记簇为已使用, 延迟写回FAT
+    link_run(start, *got);
+    if (prev)
+        write_fat(prev, start);
+    for (uint32 i = 0; i < *got; i++)
+        zero_clus(start + i); // 零化新分配的簇
+    return start;
+}
+
+ /* 分配一个空簇
+ * 参数：  dev - 设备编号
+ * 返回值：  分配到的簇的编号, 没有空闲簇时返回0 */
+static uint32 alloc_clus(uchar dev)
+{
+    uint32 got;
+    // 从空闲簇位图中取一个, 不需要扫描 FAT
+    return alloc_run(0, 1, &got);
 }
 
 /*
@@ -294,6 +676,7 @@ static void free_clus(uint32 cluster)
 {
     // 将簇标记为未使用
     write_fat(cluster, 0);
+    fmap_free(cluster);
 }
 
 /*
@@ -306,7 +689,7 @@ static void free_clus(uint32 cluster)
  *   off - 在簇内的偏移量
  *   n - 要读写的数据量
  * 返回值：
- *   实际读写的数据量
+ *   实际读写的数据量, 读盘失败时为0
  * 
  * 问题： read / write 检查
  */
@@ -315,35 +698,113 @@ static uint rw_clus(uint32 cluster, int write, int user, uint64 data, uint off,
     // 检查偏移量和数据量是否超出簇的范围
     if (off + n > fat.byts_per_clus)
         panic("offset out of range");
-    uint tot, m;
     struct buf *bp;
-    uint sec = first_sec_of_clus(cluster) + off / fat.bpb.byts_per_sec;
-    off = off % fat.bpb.byts_per_sec;
-
     int bad = 0;
-    // 循环处理所有要读写的数据
-    for (tot = 0; tot < n; tot += m, off += m, data += m, sec++) {
-        bp = bread(0, sec); // 读取对应扇区
-        m = BSIZE - off % BSIZE; // 计算本次操作在扇区内的字节数
-        if (n - tot < m) {
-            m = n - tot; // 调整本次操作的字节数
+
+    // 整簇缓存, 一次查找, 一次磁盘请求
+    bp = bread_size(fat.dev, first_sec_of_clus(cluster), fat.byts_per_clus);
+    if (!bp->valid) {
+        // 读盘失败, 缓冲块中不是簇的数据
+        brelse(bp);
+        return 0;
+    }
+    if (write) {
+        // 执行写操作，并检查是否出错
+        if ((bad = either_copy(user, data, bp->data + off, n)) != -1) {
+            bdwrite(bp); // 延迟写回
         }
-        if (write) {
-            // 执行写操作，并检查是否出错
-            if ((bad = either_copy( user, data,bp->data + (off % BSIZE), m)) != -1) {
-                bwrite(bp); // 写回扇区
-            }
-        } else {
-            // 执行读操作，并检查是否出错
-            bad = either_copy(user, data, bp->data + (off % BSIZE), m);
+    } else {
+        // 执行读操作，并检查是否出错
+        bad = either_copy(user, data, bp->data + off, n);
+    }
+    brelse(bp); // 释放缓冲区
+    return bad == -1 ? 0 : n; // 返回实际读写的数据量
+}
+/*
+ * 簇链的段映射
+ * 第一次定位时沿 FAT 链建立, 之后按二分查找. 定位超出已建立的部分时
+ * 从最后一段的末尾接着走, 所以追加的簇会自动补上; 截断时整个丢弃.
+ * 调用者持有 entry 的锁
+*/
+static void emap_reset(struct dirent *entry)
+{
+    if (entry->ext) {
+        free(entry->ext);
+    }
+    entry->ext = 0;
+    entry->nextent = 0;
+    entry->ext_cap = 0;
+}
+
+static void emap_append(struct dirent *entry, uint32 idx, uint32 clus)
+{
+    struct extent *e = entry->nextent ? &entry->ext[entry->nextent - 1] : 0;
+
+    if (e && e->idx + e->len == idx && e->clus + e->len == clus) {
+        e->len++;
+        return;
+    }
+    if (entry->nextent == entry->ext_cap) {
+        int cap = entry->ext_cap ? entry->ext_cap * 2 : 8;
+        struct extent *ext = malloc(cap * sizeof(struct extent));
+        if (entry->ext) {
+            memmove(ext, entry->ext, entry->nextent * sizeof(struct extent));
+            free(entry->ext);
         }
-        brelse(bp); // 释放缓冲区
-        if (bad == -1) {
-            break; // 如果有错误，则终止操作
+        entry->ext = ext;
+        entry->ext_cap = cap;
+    }
+    e = &entry->ext[entry->nextent++];
+    e->idx = idx;
+    e->clus = clus;
+    e->len = 1;
+}
+
+/*
+ * 把 cur_clus 定位到文件的第 idx 个簇. 簇链没有那么长时停在最后一个簇上,
+ * 由 reloc_clus 决定分配还是出错
+ */
+static void emap_seek(struct dirent *entry, uint idx)
+{
+    struct extent *e;
+    uint32 tail, next;
+    int lo, hi;
+
+    if (entry->first_clus < 2 || entry->first_clus >= FAT32_EOC) {
+        return;
+    }
+    if (entry->nextent == 0) {
+        emap_append(entry, 0, entry->first_clus);
+    }
+    // 需要的簇还没有映射, 从末尾接着沿 FAT 链走
+    e = &entry->ext[entry->nextent - 1];
+    while (idx >= e->idx + e->len) {
+        tail = e->clus + e->len - 1;
+        next = read_fat(tail);
+        if (next < 2 || next >= FAT32_EOC) {
+            entry->cur_clus = tail;
+            entry->clus_cnt = e->idx + e->len - 1;
+            return;
         }
+        emap_append(entry, e->idx + e->len, next);
+        e = &entry->ext[entry->nextent - 1];
     }
-    return tot; // 返回实际读写的数据量
+    // 找 idx 所在的段: 最后一个 e->idx <= idx 的段
+    lo = 0;
+    hi = entry->nextent - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (entry->ext[mid].idx <= idx) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    e = &entry->ext[lo];
+    entry->cur_clus = e->clus + (idx - e->idx);
+    entry->clus_cnt = idx;
 }
+
 /*
  * 根据给定的偏移量重新定位目录项的当前簇号
  * @param entry 要修改其cur_clus字段的目录项
@@ -354,14 +815,17 @@ static uint rw_clus(uint32 cluster, int write, int user, uint64 data, uint off,
 static int reloc_clus(struct dirent *entry, uint off, int alloc)
 {
     int clus_num = off / fat.byts_per_clus; // 根据偏移量计算簇号
+    // 先查段映射, 不用每次从第一个簇沿 FAT 链走
+    if (clus_num != entry->clus_cnt) {
+        emap_seek(entry, clus_num);
+    }
     // 循环处理，直到找到对应的簇号
     while (clus_num > entry->clus_cnt) {
         int clus = read_fat(entry->cur_clus); // 读取当前簇的下一个簇号
         if (clus >= FAT32_EOC) { // 如果当前簇是结束簇
-            if (alloc) { // 如果允许分配新簇
-                clus = alloc_clus(entry->dev); // 分配一个新簇
-                write_fat(entry->cur_clus, clus); // 将分配的新簇写入FAT
-            } else {
+            uint32 got;
+            // 如果允许分配新簇, 尽量紧跟在链尾之后, 并接到链上
+            if (!alloc || (clus = alloc_run(entry->cur_clus, 1, &got)) == 0) {
                 entry->cur_clus = entry->first_clus; // 重置当前簇号
                 entry->clus_cnt = 0; // 重置簇计数
                 return -1; // 返回错误
@@ -424,6 +888,126 @@ int eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n)
     return tot;
 }
 
+/*
+ * 预读文件中 off 之后的 nclus 个簇, 只把请求放入预读队列, 不等待.
+ * off 所在的簇刚被读过, 从下一个簇开始; off 正好在簇边界时从 off 所在的簇开始.
+ * 簇序号小于 done 的已经预读过, 跳过. 返回预读到的簇序号的终点.
+ * 预读队列满时停在放不进去的簇, 下次从那里重新开始, 不假定预读线程有进展.
+ * 调用者持有 entry 的锁
+ */
+uint ereadahead(struct dirent *entry, uint off, int nclus, uint done)
+{
+    uint start = (off + fat.byts_per_clus - 1) / fat.byts_per_clus;
+    uint end = start + nclus;
+    uint last = (entry->file_size + fat.byts_per_clus - 1) / fat.byts_per_clus;
+    uint32 clus = entry->cur_clus;
+    uint idx = entry->clus_cnt;
+
+    if (end > last) {
+        end = last;
+    }
+    if (start < done) {
+        start = done;
+    }
+    if ((entry->attribute & ATTR_DIRECTORY) || start >= end || idx >= end
+        || clus < 2 || clus >= FAT32_EOC) {
+        return done;
+    }
+    // 沿FAT链从当前簇往后走, cur_clus 不变
+    while (idx + 1 < end) {
+        clus = read_fat(clus);
+        if (clus < 2 || clus >= FAT32_EOC) {
+            break;
+        }
+        idx++;
+        // 设备号和 rw_clus 一致, 保证能在缓存中命中
+        if (idx >= start
+            && !breadahead(fat.dev, first_sec_of_clus(clus), fat.byts_per_clus)) {
+            return idx > done ? idx : done;
+        }
+    }
+    return idx + 1 > done ? idx + 1 : done;
+}
+
+/*
+ * 保证文件的簇链至少有 nclus 个簇, 不够时从链尾成段地分配连续簇.
+ * 空闲簇不够时释放本次分配的簇, 簇链恢复原样.
+ * 调用者持有 entry 的锁
+ * @return 0 成功, -1 空间不足
+ */
+static int eextend(struct dirent *entry, uint nclus)
+{
+    uint32 tail = 0, clus, next, got, start;
+    uint cnt = 0;
+
+    if (nclus == 0) {
+        return 0;
+    }
+    if (entry->first_clus != 0) {
+        // 从 cur_clus 走到链尾, 链上可能有预分配的簇
+        tail = entry->cur_clus;
+        cnt = entry->clus_cnt + 1;
+        while ((next = read_fat(tail)) >= 2 && next < FAT32_EOC) {
+            tail = next;
+            cnt++;
+        }
+    }
+    if (cnt >= nclus) {
+        return 0;
+    }
+    // 明显不够时不用先分配再回退
+    if (nclus - cnt > fmap.nfree) {
+        return -1;
+    }
+    start = 0;
+    for (clus = tail; cnt < nclus; cnt += got) {
+        if ((next = alloc_run(clus, nclus - cnt, &got)) == 0) {
+            goto bad;
+        }
+        if (start == 0) {
+            start = next;
+        }
+        clus = next + got - 1;
+    }
+    if (entry->first_clus == 0) {
+        entry->cur_clus = entry->first_clus = start;
+        entry->clus_cnt = 0;
+        entry->dirty = 1;
+    }
+    return 0;
+
+bad:
+    // 别的进程同时在分配, 空闲簇被取走了
+    for (clus = start; clus >= 2 && clus < FAT32_EOC; clus = next) {
+        next = read_fat(clus);
+        free_clus(clus);
+    }
+    if (tail) {
+        write_fat(tail, FAT32_EOC + 7);
+    }
+    return -1;
+}
+
+/*
+ * 预先为 [off, off + len) 分配连续的簇, 文件大小扩展到 off + len.
+ * 新分配的簇已经清零. 调用者持有 entry 的锁
+ * @return 0 成功, -1 参数错误或空间不足
+ */
+int efallocate(struct dirent *entry, uint off, uint len)
+{
+    if (off + len < off || (entry->attribute & (ATTR_DIRECTORY | ATTR_READ_ONLY))) {
+        return -1;
+    }
+    if (eextend(entry, (off + len + fat.byts_per_clus - 1) / fat.byts_per_clus) < 0) {
+        return -1;
+    }
+    if (off + len > entry->file_size) {
+        entry->file_size = off + len;
+        entry->dirty = 1;
+    }
+    return 0;
+}
+
 /*
  * 将用户空间的数据写入指定位置。
  * 
@@ -441,11 +1025,12 @@ int ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n)
         || (entry->attribute & ATTR_READ_ONLY)) {
         return -1;
     }
-    // 如果文件大小为0，分配一个簇并标记为dirty。
-    if (entry->first_clus == 0) {   
-        entry->cur_clus = entry->first_clus = alloc_clus(entry->dev);
-        entry->clus_cnt = 0;
-        entry->dirty = 1;
+    // 写到文件末尾之后时一次分配所需的全部簇, 尽量连续
+    uint have = (entry->file_size + fat.byts_per_clus - 1) / fat.byts_per_clus;
+    uint need = (off + n + fat.byts_per_clus - 1) / fat.byts_per_clus;
+    if ((entry->first_clus == 0 || need > have)
+        && eextend(entry, need > 0 ? need : 1) < 0) {
+        return -1;
     }
     uint tot, m;
     // 循环写入数据，直到达到请求的数量。
@@ -470,45 +1055,236 @@ int ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n)
     return tot;
 }
 
+/*
+ * 从 slab 中分配一个新的目录项并加入 LRU 链表头部。
+ * 调用者持有 ecache.lock
+ */
+static struct dirent *ecache_grow(void)
+{
+    struct dirent *ep = kmem_cache_alloc(&ecache.cache);
+    if (ep == 0) {
+        return 0;
+    }
+    ep->valid = 0;
+    ep->ref = 0;
+    ep->dirty = 0;
+    ep->hashed = 0;
+    ep->parent = 0;
+    ep->ext = 0;
+    ep->nextent = 0;
+    ep->ext_cap = 0;
+    ep->next = root.next;
+    ep->prev = &root;
+    root.next->prev = ep;
+    root.next = ep;
+    ecache.nentry++;
+    return ep;
+}
+
+/*
+ * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * 目录项散列表
+*/
+static uint32 ename_hash(char *name)
+{
+    uint32 h = 2166136261u;     // FNV-1a
+    for (int i = 0; i < FAT32_MAX_FILENAME && name[i]; i++) {
+        h = (h ^ (uchar)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* 查找 (parent, name) 对应的有效目录项并增加引用, 没有返回0 */
+static struct dirent *ehash_lookup(struct dirent *parent, char *name, uint32 hash)
+{
+    int h = EHASH(parent->id, hash);
+    struct dirent *ep;
+
+    acquire(&ehash[h].lock);
+    for (ep = ehash[h].head; ep; ep = ep->hnext) {
+        if (ep->pid != parent->id || ep->hash != hash
+            || strncmp(ep->filename, name, FAT32_MAX_FILENAME) != 0) {
+            continue;
+        }
+        // 替换在桶的锁下清除 valid, 这里看到的 valid 是确定的.
+        // 调用者持有 parent 的引用, parent 不会被替换
+        if (ep->valid == 1) {
+            if (__sync_fetch_and_add(&ep->ref, 1) == 0) {
+                __sync_fetch_and_add(&parent->ref, 1);
+            }
+            release(&ehash[h].lock);
+            return ep;
+        }
+    }
+    release(&ehash[h].lock);
+    return 0;
+}
+
+/*
+ * 尝试占用一个未被引用的目录项, 成功后它不再能被查找命中.
+ * 调用者持有 ecache.lock
+ */
+static int eclaim(struct dirent *ep)
+{
+    struct dirent **pp;
+    int h, ok = 0;
+
+    if (!ep->hashed) {
+        // 不在散列表中, 只能通过已有的引用 edup, ref 为0时没有人能增加它
+        return __sync_bool_compare_and_swap(&ep->ref, 0, 1);
+    }
+    h = EHASH(ep->pid, ep->hash);
+    acquire(&ehash[h].lock);
+    if (ep->ref == 0) {
+        for (pp = &ehash[h].head; *pp; pp = &(*pp)->hnext) {
+            if (*pp == ep) {
+                *pp = ep->hnext;
+                break;
+            }
+        }
+        ep->hashed = 0;
+        ep->valid = 0;
+        ep->ref = 1;
+        ok = 1;
+    }
+    release(&ehash[h].lock);
+    return ok;
+}
+
+/* 目录项生效时加入散列表, ep->parent 和 ep->filename 已经填好 */
+static void ehash_insert(struct dirent *ep)
+{
+    int h;
+
+    ep->pid = ep->parent->id;
+    ep->hash = ename_hash(ep->filename);
+    h = EHASH(ep->pid, ep->hash);
+    acquire(&ehash[h].lock);
+    ep->hnext = ehash[h].head;
+    ehash[h].head = ep;
+    ep->hashed = 1;
+    release(&ehash[h].lock);
+}
+
+static void ehash_remove(struct dirent *ep)
+{
+    struct dirent **pp;
+    int h;
+
+    if (!ep->hashed) {
+        return;
+    }
+    h = EHASH(ep->pid, ep->hash);
+    acquire(&ehash[h].lock);
+    for (pp = &ehash[h].head; *pp; pp = &(*pp)->hnext) {
+        if (*pp == ep) {
+            *pp = ep->hnext;
+            break;
+        }
+    }
+    ep->hashed = 0;
+    release(&ehash[h].lock);
+}
+
+/* 负缓存: name 是否已知不在 dp 中 */
+static int eneg_lookup(struct dirent *dp, char *name, uint32 hash)
+{
+    int h = EHASH(dp->id, hash), found = 0;
+
+    acquire(&ehash[h].lock);
+    for (int i = 0; i < ENEG_NUM; i++) {
+        struct eneg *n = &ehash[h].neg[i];
+        if (n->pid == dp->id && n->hash == hash
+            && strncmp(n->name, name, FAT32_MAX_FILENAME) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    release(&ehash[h].lock);
+    return found;
+}
+
+static void eneg_insert(struct dirent *dp, char *name, uint32 hash)
+{
+    int h = EHASH(dp->id, hash);
+    struct eneg *n;
+
+    acquire(&ehash[h].lock);
+    n = &ehash[h].neg[ehash[h].negnext];
+    ehash[h].negnext = (ehash[h].negnext + 1) % ENEG_NUM;
+    n->pid = dp->id;
+    n->hash = hash;
+    strncpy(n->name, name, FAT32_MAX_FILENAME);
+    n->name[FAT32_MAX_FILENAME] = '\0';
+    release(&ehash[h].lock);
+}
+
+static void eneg_remove(struct dirent *dp, char *name)
+{
+    uint32 hash = ename_hash(name);
+    int h = EHASH(dp->id, hash);
+
+    acquire(&ehash[h].lock);
+    for (int i = 0; i < ENEG_NUM; i++) {
+        struct eneg *n = &ehash[h].neg[i];
+        if (n->pid == dp->id && n->hash == hash
+            && strncmp(n->name, name, FAT32_MAX_FILENAME) == 0) {
+            n->pid = 0;
+        }
+    }
+    release(&ehash[h].lock);
+}
+
 /*
  * 获取指定名称的目录项。
  * 
  * @param parent 父目录的目录项指针。
  * @param name 要查找的文件或目录名称。
- * @return 找到的目录项指针，未找到或出错返回NULL。
+ * @return 找到的目录项指针，内存不足时返回NULL。
  */
 static struct dirent *eget(struct dirent *parent, char *name)
 {
     struct dirent *ep;
+    // 如果提供了文件名，则在散列表中查找是否已有该目录项。
+    if (name && (ep = ehash_lookup(parent, name, ename_hash(name))) != 0) {
+        return ep;
+    }
     acquire(&ecache.lock);
-    // 如果提供了文件名，则在缓存中查找是否已有该目录项。
-    if (name) {
-        for (ep = root.next; ep != &root; ep = ep->next) {          
-            // 查找与给定名称匹配的目录项。
-            if (ep->valid == 1 && ep->parent == parent
-                && strncmp(ep->filename, name, FAT32_MAX_FILENAME) == 0) {
-                if (ep->ref++ == 0) {
-                    ep->parent->ref++;
-                }
+    // 缓存未达到 ENTRY_CACHE_NUM 时直接增长, 否则从 LRU 尾部替换一个未被引用的目录项,
+    // 全部被引用时再增长。
+    ep = 0;
+    if (ecache.nentry < ENTRY_CACHE_NUM && (ep = ecache_grow()) != 0) {
+        ep->ref = 1;
+    }
+    if (ep == 0) {
+        struct dirent *prev;
+        int n = ecache.nentry;
+        // 被引用的目录项正在使用, 移到链表头部, 下次不用再跳过它
+        for (ep = root.prev; n > 0 && !eclaim(ep); ep = prev, n--) {
+            prev = ep->prev;
+            ep->next->prev = ep->prev;
+            ep->prev->next = ep->next;
+            ep->next = root.next;
+            ep->prev = &root;
+            root.next->prev = ep;
+            root.next = ep;
+        }
+        if (n == 0) {
+            if ((ep = ecache_grow()) == 0) {
                 release(&ecache.lock);
-                return ep;
+                return 0;
             }
-        }
-    }
-    // 在缓存中查找一个未被引用的目录项，用于新的目录项缓存。
-    for (ep = root.prev; ep != &root; ep = ep->prev) {              
-        if (ep->ref == 0) {
             ep->ref = 1;
-            ep->dev = parent->dev;
-            ep->off = 0;
-            ep->valid = 0;
-            ep->dirty = 0;
-            release(&ecache.lock);
-            return ep;
         }
     }
-    panic("eget: insufficient ecache");
-    return 0;
+    emap_reset(ep);     // 被替换的目录项的段映射作废
+    ep->id = enextid++;
+    ep->dev = parent->dev;
+    ep->off = 0;
+    ep->valid = 0;
+    ep->dirty = 0;
+    release(&ecache.lock);
+    return ep;
 }
 
 /*
@@ -673,7 +1449,9 @@ struct dirent *ealloc(struct dirent *dp, char *name, int attr)
     if ((ep = dirlookup(dp, name, &off)) != 0) {      // entry exists
         return ep;
     }
-    ep = eget(dp, name);
+    if ((ep = eget(dp, name)) == NULL) {
+        return NULL;
+    }
     elock(ep);
     ep->attribute = attr;
     ep->file_size = 0;
@@ -687,7 +1465,12 @@ struct dirent *ealloc(struct dirent *dp, char *name, int attr)
     ep->filename[FAT32_MAX_FILENAME] = '\0';
     if (attr == ATTR_DIRECTORY) {    // generate "." and ".." for ep
         ep->attribute |= ATTR_DIRECTORY;
-        ep->cur_clus = ep->first_clus = alloc_clus(dp->dev);
+        if ((ep->cur_clus = ep->first_clus = alloc_clus(dp->dev)) == 0) {
+            eunlock(ep);
+            eput(ep);
+            eput(dp);       // ep->parent 的引用
+            return NULL;
+        }
         emake(ep, ep, 0);
         emake(ep, dp, 32);
     } else {
@@ -695,6 +1478,8 @@ struct dirent *ealloc(struct dirent *dp, char *name, int attr)
     }
     emake(dp, ep, off);
     ep->valid = 1;
+    ehash_insert(ep);
+    eneg_remove(dp, name);
     eunlock(ep);
     return ep;
 }
@@ -702,9 +1487,7 @@ struct dirent *ealloc(struct dirent *dp, char *name, int attr)
 struct dirent *edup(struct dirent *entry)
 {
     if (entry != 0) {
-        acquire(&ecache.lock);
-        entry->ref++;
-        release(&ecache.lock);
+        __sync_fetch_and_add(&entry->ref, 1);
     }
     return entry;
 }
@@ -720,7 +1503,10 @@ void eupdate(struct dirent *entry)
     entcnt &= ~LAST_LONG_ENTRY;
     off = reloc_clus(entry->parent, entry->off + (entcnt << 5), 0);
     union dentry de;
-    rw_clus(entry->parent->cur_clus, 0, 0, (uint64)&de, off, sizeof(de));
+    // 读不出原来的目录项时不能写回, 保留脏标记
+    if (rw_clus(entry->parent->cur_clus, 0, 0, (uint64)&de, off, sizeof(de)) != sizeof(de)) {
+        return;
+    }
     de.shortname.fst_clus_hi = (uint16)(entry->first_clus >> 16);
     de.shortname.fst_clus_lo = (uint16)(entry->first_clus & 0xffff);
     de.shortname.file_size = entry->file_size;
@@ -746,6 +1532,7 @@ void eremove(struct dirent *entry)
         off2 = reloc_clus(entry->parent, off, 0);
     }
     entry->valid = -1;
+    ehash_remove(entry);
 }
 
 // truncate a file
@@ -760,6 +1547,7 @@ void etrunc(struct dirent *entry)
     entry->file_size = 0;
     entry->first_clus = 0;
     entry->dirty = 1;
+    emap_reset(entry);
 }
 
 void elock(struct dirent *entry)
@@ -778,40 +1566,46 @@ void eunlock(struct dirent *entry)
 
 void eput(struct dirent *entry)
 {
-    acquire(&ecache.lock);
-    if (entry != &root && entry->valid != 0 && entry->ref == 1) {
-        // ref == 1 means no other process can have entry locked,
-        // so this acquiresleep() won't block (or deadlock).
-        acquiresleeplock(&entry->lock);
-        entry->next->prev = entry->prev;
-        entry->prev->next = entry->next;
-        entry->next = root.next;
-        entry->prev = &root;
-        root.next->prev = entry;
-        root.next = entry;
-        release(&ecache.lock);
-        if (entry->valid == -1) {       // this means some one has called eremove()
-            etrunc(entry);
-        } else {
-            elock(entry->parent);
-            eupdate(entry);
-            eunlock(entry->parent);
+    int r;
+
+    // 不是最后一个引用时直接减一. 最后一个引用先写回再减, 期间可能有新的引用
+    for (;;) {
+        r = entry->ref;
+        if (entry != &root && entry->valid != 0 && r == 1) {
+            break;
         }
-        releasesleeplock(&entry->lock);
-
-        // Once entry->ref decreases down to 0, we can't guarantee the entry->parent field remains unchanged.
-        // Because eget() may take the entry away and write it.
-        struct dirent *eparent = entry->parent;
-        acquire(&ecache.lock);
-        entry->ref--;
-        release(&ecache.lock);
-        if (entry->ref == 0) {
-            eput(eparent);
+        if (__sync_bool_compare_and_swap(&entry->ref, r, r - 1)) {
+            return;
         }
-        return;
     }
-    entry->ref--;
+
+    acquire(&ecache.lock);
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = root.next;
+    entry->prev = &root;
+    root.next->prev = entry;
+    root.next = entry;
     release(&ecache.lock);
+
+    // 新的引用可能已经锁住了它, 这里不持有自旋锁, 可以等待
+    acquiresleeplock(&entry->lock);
+    if (entry->valid == -1) {       // this means some one has called eremove()
+        etrunc(entry);
+    } else {
+        elock(entry->parent);
+        eupdate(entry);
+        eunlock(entry->parent);
+    }
+    fat32_sync();   // 文件关闭时把内存中修改过的 FAT 写到缓冲块
+    releasesleeplock(&entry->lock);
+
+    // Once entry->ref decreases down to 0, we can't guarantee the entry->parent field remains unchanged.
+    // Because eget() may take the entry away and write it.
+    struct dirent *eparent = entry->parent;
+    if (__sync_sub_and_fetch(&entry->ref, 1) == 0) {
+        eput(eparent);
+    }
 }
 
 void estat(struct dirent *de, struct stat *st)
@@ -946,7 +1740,12 @@ struct dirent *dirlookup(struct dirent *dp, char *filename, uint *poff)
     if (dp->valid != 1) {
         return NULL;
     }
+    uint32 hash = ename_hash(filename);
+    if (!poff && eneg_lookup(dp, filename, hash)) {                  // 已知不存在
+        return NULL;
+    }
     struct dirent *ep = eget(dp, filename);
+    if (ep == NULL) { return NULL; }
     if (ep->valid == 1) { return ep; }                               // ecache hits
 
     int len = strlen(filename);
@@ -965,6 +1764,7 @@ struct dirent *dirlookup(struct dirent *dp, char *filename, uint *poff)
             ep->parent = edup(dp);
             ep->off = off;
             ep->valid = 1;
+            ehash_insert(ep);
             return ep;
         }
         off += count << 5;
@@ -973,6 +1773,7 @@ struct dirent *dirlookup(struct dirent *dp, char *filename, uint *poff)
         *poff = off;
     }
     eput(ep);
+    eneg_insert(dp, filename, hash);
     return NULL;
 }
 
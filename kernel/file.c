@@ -11,23 +11,25 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 #include "defs.h"
 
+/* 预读窗口的范围, 以簇为单位 */
+#define RA_MIN 2
+#define RA_MAX 16
+
 /* 定义了一个设备切换表，用于管理系统的设备驱动程序 */
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;  /* 用于文件表的自旋锁，保证并发访问的安全性 */
-  struct file file[NFILE]; /* 文件表，存储系统中打开的文件信息 */
+  struct spinlock lock;  /* 用于文件表的自旋锁，保护引用计数 */
+  struct kmem_cache cache; /* 打开的文件从 slab 中分配，数量不再受限 */
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
-  struct file *f;
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    memset(f, 0, sizeof(struct file));
-  }
+  kmem_cache_init(&ftable.cache, "file", sizeof(struct file), 0);
   /* for test */
   printf("fileinit\n");
   
@@ -38,16 +40,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return NULL;
+  if((f = kmem_cache_alloc(&ftable.cache)) == 0)
+    return NULL;
+  memset(f, 0, sizeof(struct file));
+  f->ref = 1;
+  return f;
 }
 
 struct file*
@@ -77,6 +74,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     // pipeclose(ff.pipe, ff.writable);
@@ -107,6 +105,27 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+/*
+ * 顺序读检测: 本次从上次读完的位置接着读时认为是顺序读, 预读窗口加倍,
+ * 否则窗口减半并重新开始. 调用者持有 f->ep 的锁
+ */
+static void
+readahead(struct file *f, int r)
+{
+  if(f->off == f->ra_next){
+    f->ra_win = f->ra_win ? f->ra_win * 2 : RA_MIN;
+    if(f->ra_win > RA_MAX)
+      f->ra_win = RA_MAX;
+  } else {
+    f->ra_win /= 2;
+    f->ra_end = 0;
+  }
+  f->ra_next = f->off + r;
+
+  if(f->ra_win > 0)
+    f->ra_end = ereadahead(f->ep, f->ra_next, f->ra_win, f->ra_end);
+}
+
 int
 fileread(struct file *f, uint64 addr, int n)
 {
@@ -126,8 +145,10 @@ fileread(struct file *f, uint64 addr, int n)
         break;
     case FD_ENTRY:
         elock(f->ep);
-          if((r = eread(f->ep, 1, addr, f->off, n)) > 0)
+          if((r = eread(f->ep, 1, addr, f->off, n)) > 0){
+            readahead(f, r);
             f->off += r;
+          }
         eunlock(f->ep);
         break;
     default:
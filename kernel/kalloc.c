@@ -1,71 +1,692 @@
 #include "types.h"
+#include "param.h"
 #include "riscv.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "kalloc.h"
+#include "timer.h"
 #include "defs.h"
 
+// 全局的物理页由伙伴系统管理, 可以分配 2^order 页物理地址连续的块.
+// 每个hart本地缓存单页, 页数超过 PCP_HIGH 时, 一次归还 PCP_BATCH 页给伙伴系统;
+// 本地缓存为空时, 一次从伙伴系统取 PCP_BATCH 页
+#define PCP_BATCH 16
+#define PCP_HIGH  (PCP_BATCH * 4)
+
+// 预先清零的页池大小, 每次空闲时最多清零 ZERO_BATCH 页
+#define NZEROPAGE  32
+#define ZERO_BATCH 8
+
+// 内存不足时依次调用的回收函数, 参数为需要的页数, 返回回收的对象数
+#define NSHRINKER 4
+static int (*shrinkers[NSHRINKER])(int);
+
+// 调试用的填充字节, 便于发现使用未初始化内存或释放后使用
+#define POISON_ALLOC 5
+#define POISON_FREE  1
+
 struct run {
   struct run *next;
 };
 
-struct {
+// 伙伴系统的空闲块, 链表指针放在块的第一页中
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+// 页帧号从 OPEN_SBI 开始计算, 保证 2^order 页的块物理地址按块大小对齐,
+// 这样 order 9 的块可以直接作为 2MiB 的大页
+#define NPFN        ((PHYSTOP - OPEN_SBI) >> PGSHIFT)
+#define PA2PFN(pa)  (((uint64)(pa) - OPEN_SBI) >> PGSHIFT)
+#define PFN2PA(pfn) ((char *)(OPEN_SBI + ((uint64)(pfn) << PGSHIFT)))
+
+// pginfo 中空闲块首页的标记, 低位为块的 order
+#define PG_FREE     0x80
+
+// 每个hart私有的页缓存(magazine), 只有偷页时其他hart才会访问
+struct pcp {
   struct spinlock lock;
   struct run *freelist;
+  int count;
+
+  // 统计信息
+  uint64 hit;       // 直接命中本地缓存
+  uint64 refill;    // 从全局链表批量补充
+  uint64 drain;     // 批量归还给全局链表
+  uint64 steal;     // 从其他hart偷页
+  uint64 fail;      // 分配失败
+};
+
+struct {
+  struct spinlock lock;
+  struct block area[MAX_ORDER + 1];   // 各阶空闲块的双向循环链表
+  int nblock[MAX_ORDER + 1];          // 各阶空闲块的个数
+  int nfree;                          // 伙伴系统中的空闲页数
+  uchar pginfo[NPFN];                 // 空闲块首页记录 PG_FREE | order, 其余为0
+
+  struct pcp pcp[NCPU];
 } kmem;
 
+// 已经清零的空闲页, 由调度器空闲时补充
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int count;
+  uint64 hit;
+  uint64 miss;
+} kzero;
+
 extern char end[];
 
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i <= MAX_ORDER; i++)
+  {
+    kmem.area[i].next = &kmem.area[i];
+    kmem.area[i].prev = &kmem.area[i];
+  }
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.pcp[i].lock, "kmem_pcp");
   freerange(end, (void *)PHYSTOP);
 }
 
+static inline void
+_area_push(uint64 pfn, int order)
+{
+  struct block *b = (struct block *)PFN2PA(pfn);
+
+  kmem.pginfo[pfn] = PG_FREE | order;
+  b->next = kmem.area[order].next;
+  b->prev = &kmem.area[order];
+  kmem.area[order].next->prev = b;
+  kmem.area[order].next = b;
+  kmem.nblock[order]++;
+}
+
+static inline void
+_area_remove(uint64 pfn, int order)
+{
+  struct block *b = (struct block *)PFN2PA(pfn);
+
+  kmem.pginfo[pfn] = 0;
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  kmem.nblock[order]--;
+}
+
+// 分配一个 2^order 页的块, 不够时拆分更大的块. 调用者持有 kmem.lock
+static char *
+_buddy_alloc(int order)
+{
+  uint64 pfn;
+  int k;
+
+  for(k = order; k <= MAX_ORDER; k++)
+    if(kmem.area[k].next != &kmem.area[k])
+      break;
+  if(k > MAX_ORDER)
+    return 0;
+
+  pfn = PA2PFN(kmem.area[k].next);
+  _area_remove(pfn, k);
+
+  // 高地址的一半放回低一阶
+  while(k > order)
+  {
+    k--;
+    _area_push(pfn + (1UL << k), k);
+  }
+
+  kmem.nfree -= 1 << order;
+  return PFN2PA(pfn);
+}
+
+// 释放一个 2^order 页的块, 伙伴空闲时合并. 调用者持有 kmem.lock
+static void
+_buddy_free(char *pa, int order)
+{
+  uint64 pfn = PA2PFN(pa), buddy;
+
+  kmem.nfree += 1 << order;
+  while(order < MAX_ORDER)
+  {
+    buddy = pfn ^ (1UL << order);
+    if(buddy >= NPFN || kmem.pginfo[buddy] != (PG_FREE | order))
+      break;
+    _area_remove(buddy, order);
+    pfn &= ~(1UL << order);
+    order++;
+  }
+  _area_push(pfn, order);
+}
+
+// 把 [pfn, end) 切成尽可能大的对齐块放入伙伴系统. 调用者持有 kmem.lock
+static void
+_free_pfn_range(uint64 pfn, uint64 end)
+{
+  int order;
+
+  while(pfn < end)
+  {
+    for(order = MAX_ORDER; order > 0; order--)
+      if((pfn & ((1UL << order) - 1)) == 0 && pfn + (1UL << order) <= end)
+        break;
+    _buddy_free(PFN2PA(pfn), order);
+    pfn += 1UL << order;
+  }
+}
+
+// 把一段空闲内存交给伙伴系统. 只在每个最大对齐块的首页写入链表指针,
+// 不逐页访问, 所以启动时间与内存大小基本无关
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char *)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char *)pa_end; p += PGSIZE)
+  uint64 start = PGROUNDUP((uint64)pa_start);
+  uint64 stop = PGROUNDDOWN((uint64)pa_end);
+
+  if(start >= stop)
+    return;
+
+  acquire(&kmem.lock);
+  _free_pfn_range(PA2PFN(start), PA2PFN(stop));
+  release(&kmem.lock);
+}
+
+// 从伙伴系统取出最多n个单页, 串成链表返回, 实际页数写入 *got
+// 调用者不能持有 kmem.lock
+static struct run *
+_global_get(int n, int *got)
+{
+  struct run *head = 0, *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < n && (r = (struct run *)_buddy_alloc(0)) != 0; i++)
   {
-    kfree(p);
+    r->next = head;
+    head = r;
   }
+  release(&kmem.lock);
+
+  *got = i;
+  return head;
+}
+
+// 将本地缓存的前n页归还全局链表, 调用者持有 pc->lock
+static void
+_pcp_drain(struct pcp *pc, int n)
+{
+  struct run *head, *tail;
+  int i;
+
+  head = tail = pc->freelist;
+  for(i = 1; i < n && tail->next; i++)
+    tail = tail->next;
+  pc->freelist = tail->next;
+  pc->count -= i;
+  pc->drain++;
+
+  tail->next = 0;
+  acquire(&kmem.lock);
+  for(; head; head = tail)
+  {
+    tail = head->next;
+    _buddy_free((char *)head, 0);
+  }
+  release(&kmem.lock);
+}
+
+// 本地和全局都没有空闲页时, 从其他hart的缓存中偷一半过来
+// 返回一页, 剩下的放入本地缓存. 调用者关闭中断, 且不持有任何pcp锁,
+// 这样两个hart互相偷页时不会死锁
+static struct run *
+_pcp_steal(int id)
+{
+  struct pcp *victim, *pc = &kmem.pcp[id];
+  struct run *head = 0, *r;
+  int i, n = 0;
+
+  for(i = 0; i < NCPU && head == 0; i++)
+  {
+    if(i == id)
+      continue;
+    victim = &kmem.pcp[i];
+    acquire(&victim->lock);
+    for(n = 0; n < (victim->count + 1) / 2; n++)
+    {
+      r = victim->freelist;
+      victim->freelist = r->next;
+      r->next = head;
+      head = r;
+    }
+    victim->count -= n;
+    release(&victim->lock);
+  }
+
+  if(head == 0)
+    return 0;
+
+  r = head;
+  head = head->next;
+
+  acquire(&pc->lock);
+  pc->steal++;
+  while(head)
+  {
+    struct run *next = head->next;
+    head->next = pc->freelist;
+    pc->freelist = head;
+    pc->count++;
+    head = next;
+  }
+  release(&pc->lock);
+
+  return r;
 }
 
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct pcp *pc;
 
   if(((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa > PHYSTOP)
     panic("kfree");
 
-  memset(pa, 1, PGSIZE);
+#ifdef KALLOC_DEBUG
+  memset(pa, POISON_FREE, PGSIZE);
+#endif
 
   r = (struct run *)pa;
 
+  push_off();
+  pc = &kmem.pcp[cpuid()];
+  acquire(&pc->lock);
+  r->next = pc->freelist;
+  pc->freelist = r;
+  pc->count++;
+  if(pc->count > PCP_HIGH)
+    _pcp_drain(pc, PCP_BATCH);
+  release(&pc->lock);
+  pop_off();
+}
+
+static void *
+_kalloc_page(void)
+{
+  struct run *r;
+  struct pcp *pc;
+  int id, got;
+
+  push_off();
+  id = cpuid();
+  pc = &kmem.pcp[id];
+
+  acquire(&pc->lock);
+  if(pc->freelist == 0)
+  {
+    pc->freelist = _global_get(PCP_BATCH, &got);
+    pc->count += got;
+    if(got)
+      pc->refill++;
+  } else {
+    pc->hit++;
+  }
+
+  r = pc->freelist;
+  if(r)
+  {
+    pc->freelist = r->next;
+    pc->count--;
+  }
+  release(&pc->lock);
+
+  if(r == 0)
+    r = _pcp_steal(id);
+  pop_off();
+
+  return (void *)r;
+}
+
+// 注册一个内存不足时的回收函数
+void
+register_shrinker(int (*fn)(int))
+{
+  for(int i = 0; i < NSHRINKER; i++)
+  {
+    if(shrinkers[i] == 0)
+    {
+      shrinkers[i] = fn;
+      return;
+    }
+  }
+  panic("register_shrinker");
+}
+
+// 调用所有回收函数, 返回是否回收到了东西
+// 回收函数会拿别的锁, 所以调用者不能持有任何自旋锁.
+// 持有自旋锁时中断是关闭的, 这时不回收, 由调用者放开锁后调用 kshrink()
+static int
+_shrink(int npages)
+{
+  int n = 0;
+
+  if(!intr_get())
+    return 0;
+  for(int i = 0; i < NSHRINKER && shrinkers[i]; i++)
+    n += shrinkers[i](npages);
+  return n > 0;
+}
+
+// 给在锁内分配失败的 buddy, slab 使用, 放开锁后回收再重试
+int
+kshrink(int npages)
+{
+  return _shrink(npages);
+}
+
+// stat 不为0时记录命中和未命中, 和取页在同一把锁下
+static void *
+_kzero_get(int stat)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r)
+  {
+    kzero.freelist = r->next;
+    kzero.count--;
+  }
+  if(stat)
+  {
+    if(r)
+      kzero.hit++;
+    else
+      kzero.miss++;
+  }
+  release(&kzero.lock);
+
+  return (void *)r;
+}
+
+// 分配一页物理内存
+// flags:
+//   KALLOC_RAW     不做任何初始化
+//   KALLOC_ZERO    返回清零的页, 优先从预清零池中取
+//   KALLOC_POISON  填充 POISON_ALLOC, 用于调试
+void *
+kalloc_flags(int flags)
+{
+  char *pa;
+
+  if(flags & KALLOC_ZERO)
+  {
+    if((pa = _kzero_get(1)) != 0)
+    {
+      // 链表指针写在页首, 需要重新清零
+      *(struct run **)pa = 0;
+      return pa;
+    }
+  }
+
+  // 普通空闲页耗尽时, 预清零池中的页也可以使用, 最后尝试回收缓存
+  if((pa = _kalloc_page()) == 0 && (pa = _kzero_get(0)) == 0
+     && (!_shrink(1) || (pa = _kalloc_page()) == 0))
+  {
+    push_off();
+    kmem.pcp[cpuid()].fail++;
+    pop_off();
+    return 0;
+  }
+
+#ifdef KALLOC_DEBUG
+  flags |= KALLOC_POISON;
+#endif
+
+  if(flags & KALLOC_ZERO)
+    memset(pa, 0, PGSIZE);
+  else if(flags & KALLOC_POISON)
+    memset(pa, POISON_ALLOC, PGSIZE);
+
+  return (void *)pa;
+}
+
+void *
+kalloc(void)
+{
+  return kalloc_flags(KALLOC_RAW);
+}
+
+// 把所有hart缓存的单页还给伙伴系统, 让它们有机会合并成大块.
+// 不移动已分配的页, 是高阶分配失败时的回退手段
+static void
+_pcp_flush_all(void)
+{
+  struct pcp *pc;
+
+  for(pc = kmem.pcp; pc < kmem.pcp + NCPU; pc++)
+  {
+    acquire(&pc->lock);
+    if(pc->count > 0)
+      _pcp_drain(pc, pc->count);
+    release(&pc->lock);
+  }
+}
+
+// 分配 2^order 页物理地址连续, 按块大小对齐的内存, 不初始化
+void *
+kalloc_pages(int order)
+{
+  char *pa;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAX_ORDER)
+    return 0;
+
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  pa = _buddy_alloc(order);
   release(&kmem.lock);
+
+  if(pa == 0)
+  {
+    _shrink(1 << order);
+    _pcp_flush_all();
+    acquire(&kmem.lock);
+    pa = _buddy_alloc(order);
+    release(&kmem.lock);
+  }
+
+  return pa;
 }
 
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0)
+  {
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa & (((uint64)PGSIZE << order) - 1)) != 0 || (char *)pa < end
+     || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  acquire(&kmem.lock);
+  _buddy_free(pa, order);
+  release(&kmem.lock);
+}
+
+// 分配n页物理地址连续的内存, 不初始化
+// 按 2^order 分配后把尾部多余的页还给伙伴系统
 void *
-kalloc(void)
+kalloc_run(int n)
 {
+  int order = 0;
+  char *pa;
+
+  while((1 << order) < n)
+    order++;
+  if((pa = kalloc_pages(order)) == 0 || (1 << order) == n)
+    return pa;
+
   acquire(&kmem.lock);
-  struct run *r = kmem.freelist;
+  _free_pfn_range(PA2PFN(pa) + n, PA2PFN(pa) + (1 << order));
+  release(&kmem.lock);
 
-  if(r)
+  return pa;
+}
+
+// 释放 kalloc_run() 分配的n页
+void
+kfree_run(void *pa, int n)
+{
+  if(n == 1)
   {
-    kmem.freelist = r->next;
+    kfree(pa);
+    return;
   }
 
+  acquire(&kmem.lock);
+  _free_pfn_range(PA2PFN(pa), PA2PFN(pa) + n);
   release(&kmem.lock);
+}
 
-  if(r)
-    memset((char *)r, 5, PGSIZE);
+// 外部碎片指数(百分比): 空闲页中, 位于小于 2^order 页的块里,
+// 因而无法满足 order 阶分配的比例
+int
+kmem_frag(int order)
+{
+  int k, small = 0, total;
 
-  return (void *)r;
+  acquire(&kmem.lock);
+  total = kmem.nfree;
+  for(k = 0; k < order && k <= MAX_ORDER; k++)
+    small += kmem.nblock[k] << k;
+  release(&kmem.lock);
+
+  if(total == 0)
+    return 100;
+  return small * 100 / total;
+}
+
+// 在调度器空闲时调用, 补充预清零的页池
+// 每次最多清零 ZERO_BATCH 页, 避免推迟 wfi 过久
+void
+kzero_refill(void)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < ZERO_BATCH && kzero.count < NZEROPAGE; i++)
+  {
+    if((r = _kalloc_page()) == 0)
+      break;
+    memset(r, 0, PGSIZE);
+
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.count++;
+    release(&kzero.lock);
+  }
+}
+
+// 输出页分配器的统计信息, 用于确认本地命中率
+void
+kmem_info()
+{
+  printf("===================================================\n");
+  printf("kmem: buddy free %d pages, frag(order 4) %d%%, frag(order 9) %d%%\n",
+         kmem.nfree, kmem_frag(4), kmem_frag(9));
+  printf("kmem: free blocks per order:");
+  for(int k = 0; k <= MAX_ORDER; k++)
+    printf(" %d", kmem.nblock[k]);
+  printf("\n");
+  printf("kzero: pool %d hit %d miss %d\n", kzero.count, (int)kzero.hit, (int)kzero.miss);
+  for(int i = 0; i < NCPU; i++)
+  {
+    struct pcp *pc = &kmem.pcp[i];
+    printf("hart %d: cached %d hit %d refill %d drain %d steal %d fail %d\n",
+           i, pc->count, (int)pc->hit, (int)pc->refill, (int)pc->drain,
+           (int)pc->steal, (int)pc->fail);
+  }
+  printf("===================================================\n");
+}
+
+#ifdef BENCH
+#define BENCH_NSLOT     1024
+#define BENCH_MAXORDER  3
+#define BENCH_OCCUPANCY 90    // 填充到空闲页的百分比
+#define BENCH_ITERS     4000
+
+// 在高占用率下测量各阶分配的延迟
+void
+kalloc_bench()
+{
+  static struct { char *pa; int order; } slot[BENCH_NSLOT];
+  uint64 seed = 54321, t, dt;
+  uint64 sum[BENCH_MAXORDER + 1], max[BENCH_MAXORDER + 1];
+  int cnt[BENCH_MAXORDER + 1], fail[BENCH_MAXORDER + 1];
+  int i, k, n = 0, used = 0, target;
+
+  memset(sum, 0, sizeof(sum));
+  memset(max, 0, sizeof(max));
+  memset(cnt, 0, sizeof(cnt));
+  memset(fail, 0, sizeof(fail));
+
+  // 随机阶数填充到目标占用率
+  target = kmem.nfree * BENCH_OCCUPANCY / 100;
+  while(used < target && n < BENCH_NSLOT)
+  {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    k = (seed >> 33) % (BENCH_MAXORDER + 1);
+    if((slot[n].pa = kalloc_pages(k)) == 0)
+      break;
+    slot[n++].order = k;
+    used += 1 << k;
+  }
+  printf("[bench] kalloc: filled %d pages in %d blocks, frag(order 3) %d%%\n",
+         used, n, kmem_frag(3));
+
+  // 保持占用率, 随机释放一块再分配一块
+  for(i = 0; i < BENCH_ITERS && n > 0; i++)
+  {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    int victim = (seed >> 33) % n;
+    kfree_pages(slot[victim].pa, slot[victim].order);
+
+    k = (seed >> 17) % (BENCH_MAXORDER + 1);
+    t = r_time();
+    slot[victim].pa = kalloc_pages(k);
+    dt = r_time() - t;
+    if(slot[victim].pa == 0)
+    {
+      fail[k]++;
+      slot[victim] = slot[--n];
+      continue;
+    }
+    slot[victim].order = k;
+    sum[k] += dt;
+    cnt[k]++;
+    if(dt > max[k])
+      max[k] = dt;
+  }
+
+  for(k = 0; k <= BENCH_MAXORDER; k++)
+  {
+    printf("[bench] kalloc order %d: %d allocs, avg %d ns, max %d ns, %d failed\n",
+           k, cnt[k], cnt[k] ? (int)(sum[k] * 100 / cnt[k]) : 0,
+           (int)(max[k] * 100), fail[k]);
+  }
+  printf("[bench] kalloc: frag(order 3) %d%%\n", kmem_frag(3));
+
+  for(i = 0; i < n; i++)
+    kfree_pages(slot[i].pa, slot[i].order);
 }
+#endif
@@ -8,9 +8,28 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fat32.h"
+#include "slab.h"
+#include "mmap.h"
+#include "timer.h"
 #include "defs.h"
 volatile static int started = 0;
 
+// 启动阶段计时, 单位为 time 寄存器的计数
+static uint64 boot_start;
+static uint64 boot_last;
+
+// 输出上一个启动阶段的耗时以及总耗时(微秒)
+static void
+boot_trace(char *stage)
+{
+  uint64 now = r_time();
+  uint64 tpus = CLOCK_FREQ / 1000000;
+
+  printf("[boot] %s: %d us (total %d us)\n", stage,
+         (int)((now - boot_last) / tpus), (int)((now - boot_start) / tpus));
+  boot_last = now;
+}
+
 typedef void (*function_t)();
 // 在kernel.ld中提供
 extern function_t __init_array_start[];
@@ -33,23 +52,41 @@ main(uint64 hartid, uint64 dtb_pa)
   cpuinit(hartid);
   if(hartid == 0)
   {
+    boot_start = boot_last = r_time();
     consoleinit();
     printfinit();
     printf("paintingOS\n");
+    boot_trace("console");
     _call_global_constructor();   // 初始化全局对象
     kinit();      // 初始化物理内存分配器
+    boot_trace("kinit");
     buddyinit();  // 初始化通用内存分配器
+    slabinit();   // 初始化对象缓存分配器
     kvminit();    // 初始化内核虚拟内存
     kvminithart();  // 启用分页
+    boot_trace("kvminit");
+#ifdef BENCH
+    kalloc_bench();
+    buddy_bench();
+#endif
     timerinit();
     binit();        // 缓冲区初始化
+    boot_trace("binit");
     trapinithart();
     plicinit();
     plicinithart();
-    devinit();
+    disk_init();
+    ramdisk_init(RAMDEV);
+    boot_trace("devinit");
+#ifdef BENCH
+    virtio_bench();
+#endif
     inittasktable();
     initfirsttask();
     fileinit();
+    bthreadinit();  // 启动写回和预读线程
+    InitVmaTable();
+    boot_trace("proc/file");
     // fat32_init()
     
     int i;
@@ -0,0 +1,37 @@
+/*
+ * mmap 使用的虚拟内存区域(vma)
+*/
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "mmap.h"
+#include "slab.h"
+#include "defs.h"
+
+static struct kmem_cache vma_cache;
+
+void
+InitVmaTable()
+{
+  kmem_cache_init(&vma_cache, "vma", sizeof(struct vma), 0);
+}
+
+// 分配一个清零的 vma, 内存不足时返回0
+struct vma *
+allocvma()
+{
+  struct vma *vma;
+
+  if((vma = kmem_cache_alloc(&vma_cache)) == 0)
+    return 0;
+  memset(vma, 0, sizeof(*vma));
+  return vma;
+}
+
+void
+freevma(struct vma *vma)
+{
+  kmem_cache_free(&vma_cache, vma);
+}
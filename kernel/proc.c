@@ -6,6 +6,7 @@
 #include "riscv.h"
 #include "mmap.h"
 #include "proc.h"
+#include "kalloc.h"
 #include "defs.h"
 
 struct proc proc[NPROC];
@@ -84,7 +85,7 @@ allocproc()
   return 0;
 
 found:
-  if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
+  if ((p->trapframe = (struct trapframe *)kalloc_flags(KALLOC_ZERO)) == 0) {
     release(&p->lock);
     return 0;
   }
@@ -93,7 +94,6 @@ found:
   p->pagetable = proc_pagetable(p);
 
   memset(&p->context, 0, sizeof(p->context));
-  memset(p->trapframe, 0, sizeof(*p->trapframe));
   memset(p->vma, 0, sizeof(p->vma));
   memset(p->ofile, 0, sizeof(p->ofile));
   p->context.sp = p->kstack + KSTACK_SIZE;
@@ -161,6 +161,36 @@ forkret(void)
   usertrapret();
 }
 
+// 内核线程第一次被调度时从这里开始
+// 和 forkret 一样, 先释放 scheduler 持有的 p->lock
+static void
+kthread_start(void)
+{
+  struct proc *p = myproc();
+
+  release(&p->lock);
+  p->kfn();
+  panic("kthread exit");
+}
+
+// 创建一个只在内核态运行的线程, fn 不应该返回
+struct proc *
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread_create");
+
+  acquire(&p->lock);
+  p->kfn = fn;
+  p->context.ra = (uint64)kthread_start;
+  strncpy(p->name, name, sizeof(p->name) - 1);
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return p;
+}
+
 void
 wakeup(void *chan)
 {
@@ -250,10 +280,26 @@ exit(int status)
   panic("exit");
 }
 
+// 切换回本hart的 scheduler. 调用者只持有 p->lock, 并且已经改变了 p->state.
+// intena 属于这个内核线程而不是这个CPU, 所以要保存和恢复
 void
 sched()
 {
-  panic("sched todo");
+  int intena;
+  struct proc *p = myproc();
+
+  if(!holding(&p->lock))
+    panic("sched p->lock");
+  if(mycpu()->noff != 1)
+    panic("sched locks");
+  if(p->state == RUNNING)
+    panic("sched running");
+  if(intr_get())
+    panic("sched interruptible");
+
+  intena = mycpu()->intena;
+  swtch(&p->context, &mycpu()->context);
+  mycpu()->intena = intena;
 }
 
 void
@@ -668,7 +714,7 @@ scheduler()
 
   struct cpu *c = mycpu();
 
-  int alive = 0;
+  int found;
 
   c->proc = 0;
 
@@ -676,7 +722,7 @@ scheduler()
   {
     // 关闭中断
     intr_on();
-    alive = 0;
+    found = 0;
 
     int i;
     for(i = 0; i < NPROC; i++)
@@ -684,26 +730,28 @@ scheduler()
       p = &proc[i];
       acquire(&p->lock);
 
-      if(p->state != UNUSED && p->state != ZOMBIE)
-        ++alive;
-
       if(p->state == ZOMBIE) {
         initproc->state = RUNNABLE;
       }
 
       if(p->state == RUNNABLE)
       {
-        p->state = RUNNABLE;
-        c->proc = proc;
+        p->state = RUNNING;
+        c->proc = p;
         swtch(&c->context, &p->context);
         c->proc = 0;
+        found = 1;
       }
 
       release(&p->lock);
     }
-    if (alive < 1)
+    // 内核线程一直存在, 不能按存活的进程数判断空闲,
+    // 一轮下来没有可运行的进程就等待中断
+    if (!found)
     {
       intr_on();
+      // 空闲时顺便补充预清零的页池
+      kzero_refill();
       asm volatile("wfi");
     }
   }
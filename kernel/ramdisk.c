@@ -0,0 +1,142 @@
+/*
+ * 内存盘
+ * 数据放在按页分配的物理内存中, 请求在提交时同步完成.
+ * 没有设备延迟, 用来单独测量 buffer cache 和文件系统的开销.
+ * 页在第一次写入时才分配, 没有写过的扇区读出来是0
+*/
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "buf.h"
+#include "kalloc.h"
+#include "blkdev.h"
+#include "defs.h"
+
+#define RAM_NPAGE  (RAMDISK_KB * 1024 / PGSIZE)
+#define RAM_PERPG  (PGSIZE / BSIZE)
+
+static struct {
+  struct spinlock lock;
+  char *page[RAM_NPAGE];
+  uint64 nread;
+  uint64 nwrite;
+} ram;
+
+// 扇区 sec 所在的页, 没有分配过时写请求分配一页, 读请求返回0
+static char *
+ram_page(uint sec, int write)
+{
+  char **pp = &ram.page[sec / RAM_PERPG];
+  char *p;
+
+  if(*pp || !write)
+    return *pp;
+  if((p = kalloc_flags(KALLOC_ZERO)) == 0)
+    return 0;
+  acquire(&ram.lock);
+  if(*pp == 0)
+  {
+    *pp = p;
+    p = 0;
+  }
+  release(&ram.lock);
+  if(p)
+    kfree(p);
+  return *pp;
+}
+
+// 没有内存分配新页时设置 b->error
+static void
+ram_copy(struct buf *b, int write)
+{
+  uint sec = b->sectorno;
+  uint off;
+  char *p;
+
+  for(off = 0; off < b->size; off += BSIZE, sec++)
+  {
+    if((p = ram_page(sec, write)) == 0)
+    {
+      if(write)
+      {
+        b->error = 1;
+        return;
+      }
+      memset(b->data + off, 0, BSIZE);
+      continue;
+    }
+    p += (sec % RAM_PERPG) * BSIZE;
+    if(write)
+      memmove(p, b->data + off, BSIZE);
+    else
+      memmove(b->data + off, p, BSIZE);
+  }
+}
+
+// 请求在这里就完成了, 和 virtio 的中断一样清除 b->disk 并调用 end_io
+static void
+ram_submit(struct buf **bufs, int n, int write)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    ram_copy(bufs[i], write);
+
+  acquire(&ram.lock);
+  for(i = 0; i < n; i++)
+  {
+    bufs[i]->disk = 0;
+    wakeup(bufs[i]);
+  }
+  if(write)
+    ram.nwrite += n;
+  else
+    ram.nread += n;
+  release(&ram.lock);
+
+  for(i = 0; i < n; i++)
+    if(bufs[i]->end_io)
+      bufs[i]->end_io(bufs[i]);
+}
+
+// 请求可能还在调度队列中(plug 期间), 要等它被派发
+static void
+ram_wait(struct buf *b)
+{
+  acquire(&ram.lock);
+  while(b->disk)
+    sleep(b, &ram.lock);
+  release(&ram.lock);
+}
+
+static int
+ram_inflight(void)
+{
+  return 0;
+}
+
+static void
+ram_info(void)
+{
+  printf("ramdisk: %d KB, %d reads %d writes\n", RAMDISK_KB,
+         (int)ram.nread, (int)ram.nwrite);
+}
+
+static struct blkdev_ops ram_ops = {
+  .submit   = ram_submit,
+  .wait     = ram_wait,
+  .inflight = ram_inflight,
+  .info     = ram_info,
+};
+
+// 注册为设备 dev, 容量 RAMDISK_KB, 内存在写入时才分配
+void
+ramdisk_init(int dev)
+{
+  initlock(&ram.lock, "ramdisk");
+  // 同步完成, 不需要限制深度
+  blkdev_register(dev, "ramdisk", &ram_ops, RAM_NPAGE * RAM_PERPG, NPROC);
+}
@@ -0,0 +1,293 @@
+/*
+ * 对象缓存(slab)分配器
+ * 给 dirent, file, buf, vma 等固定大小的内核对象使用,
+ * 避免伙伴分配器按2的幂取整造成的浪费
+*/
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "defs.h"
+
+// 对象按8字节对齐
+#define SLAB_ALIGN 8
+#define ALIGNUP(x) (((x) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+// 对象区域在页内的起始偏移
+#define SLAB_OBJOFF ALIGNUP(sizeof(struct slab))
+
+static struct spinlock slab_lock;   // 保护 caches 链表
+static struct kmem_cache *caches;
+
+#define FREEPTR(c, obj) (*(void **)((char *)(obj) + (c)->freeoff))
+
+static inline void
+_list_init(struct slab *head)
+{
+  head->next = head;
+  head->prev = head;
+}
+
+static inline int
+_list_empty(struct slab *head)
+{
+  return head->next == head;
+}
+
+static inline void
+_list_del(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static inline void
+_list_add(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+// 初始化一个对象缓存
+// 有构造函数时, 空闲链表指针放在对象之后, 不破坏对象构造后的状态
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size, void (*ctor)(void *))
+{
+  memset(c, 0, sizeof(*c));
+  strncpy(c->name, name, SLAB_NAME - 1);
+  c->objsize = size;
+  c->ctor = ctor;
+  if(ctor)
+  {
+    c->freeoff = ALIGNUP(size);
+    c->size = c->freeoff + sizeof(void *);
+  } else {
+    c->freeoff = 0;
+    c->size = ALIGNUP(size < sizeof(void *) ? sizeof(void *) : size);
+  }
+  c->nperslab = (PGSIZE - SLAB_OBJOFF) / c->size;
+  if(c->nperslab == 0)
+    panic("kmem_cache_init: object too large");
+
+  initlock(&c->lock, "kmem_cache");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, "kmem_mag");
+  _list_init(&c->partial);
+  _list_init(&c->full);
+  _list_init(&c->empty);
+
+  acquire(&slab_lock);
+  c->next = caches;
+  caches = c;
+  release(&slab_lock);
+}
+
+// 分配一页作为新的slab, 构造其中所有对象. 调用者持有 c->lock
+static struct slab *
+_slab_grow(struct kmem_cache *c)
+{
+  struct slab *s = kalloc();
+  char *obj;
+  int i;
+
+  if(s == 0)
+    return 0;
+
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0;
+  obj = (char *)s + SLAB_OBJOFF + (c->nperslab - 1) * c->size;
+  for(i = 0; i < c->nperslab; i++, obj -= c->size)
+  {
+    if(c->ctor)
+      c->ctor(obj);
+    FREEPTR(c, obj) = s->freelist;
+    s->freelist = obj;
+  }
+  c->nslab++;
+  return s;
+}
+
+// 从slab中取一个对象. 调用者持有 c->lock
+static void *
+_slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if(!_list_empty(&c->partial))
+  {
+    s = c->partial.next;
+    _list_del(s);
+  } else if(!_list_empty(&c->empty)) {
+    s = c->empty.next;
+    _list_del(s);
+  } else if((s = _slab_grow(c)) == 0) {
+    return 0;
+  }
+
+  obj = s->freelist;
+  s->freelist = FREEPTR(c, obj);
+  s->inuse++;
+  _list_add(s->inuse == c->nperslab ? &c->full : &c->partial, s);
+
+  return obj;
+}
+
+// 把对象还给所在的slab. 调用者持有 c->lock
+static void
+_slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab *)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+
+  FREEPTR(c, obj) = s->freelist;
+  s->freelist = obj;
+  _list_del(s);
+  if(--s->inuse > 0)
+  {
+    _list_add(&c->partial, s);
+  } else if(_list_empty(&c->empty)) {
+    _list_add(&c->empty, s);
+  } else {
+    // 已经保留了一个空slab, 多余的还给页分配器
+    c->nslab--;
+    kfree(s);
+  }
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj = 0;
+  int id, shrunk = 0;
+
+retry:
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+
+  // magazine 为空时加锁一次补充一半
+  if(c->mag[id].count == 0)
+  {
+    acquire(&c->lock);
+    while(c->mag[id].count < SLAB_MAG / 2)
+    {
+      if((obj = _slab_get(c)) == 0)
+        break;
+      c->mag[id].obj[c->mag[id].count++] = obj;
+    }
+    release(&c->lock);
+  }
+
+  obj = 0;
+  if(c->mag[id].count > 0)
+  {
+    obj = c->mag[id].obj[--c->mag[id].count];
+    c->mag[id].nalloc++;
+  }
+  release(&c->mag[id].lock);
+  pop_off();
+
+  // 持有 c->lock 时 kalloc 不会回收内存, 放开后回收一次再试
+  if(obj == 0 && !shrunk++ && kshrink(1))
+    goto retry;
+
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  int id;
+
+  if(obj == 0)
+    return;
+
+  push_off();
+  id = cpuid();
+  acquire(&c->mag[id].lock);
+
+  // magazine 已满时加锁一次归还一半
+  if(c->mag[id].count == SLAB_MAG)
+  {
+    acquire(&c->lock);
+    while(c->mag[id].count > SLAB_MAG / 2)
+      _slab_put(c, c->mag[id].obj[--c->mag[id].count]);
+    release(&c->lock);
+  }
+
+  c->mag[id].obj[c->mag[id].count++] = obj;
+  c->mag[id].nfree++;
+  release(&c->mag[id].lock);
+  pop_off();
+}
+
+// 把所有hart的 magazine 全部归还, 并释放空的slab
+void
+kmem_cache_shrink(struct kmem_cache *c)
+{
+  struct slab *s;
+
+  for(int id = 0; id < NCPU; id++)
+  {
+    acquire(&c->mag[id].lock);
+    acquire(&c->lock);
+    while(c->mag[id].count > 0)
+      _slab_put(c, c->mag[id].obj[--c->mag[id].count]);
+    release(&c->lock);
+    release(&c->mag[id].lock);
+  }
+
+  acquire(&c->lock);
+  while(!_list_empty(&c->empty))
+  {
+    s = c->empty.next;
+    _list_del(s);
+    c->nslab--;
+    kfree(s);
+  }
+  release(&c->lock);
+}
+
+// 输出各个对象缓存的使用情况
+void
+slab_info()
+{
+  struct kmem_cache *c;
+
+  printf("===================================================\n");
+  acquire(&slab_lock);
+  for(c = caches; c; c = c->next)
+  {
+    uint64 nalloc = 0, nfree = 0;
+    int cached = 0;
+
+    for(int id = 0; id < NCPU; id++)
+    {
+      acquire(&c->mag[id].lock);
+      nalloc += c->mag[id].nalloc;
+      nfree += c->mag[id].nfree;
+      cached += c->mag[id].count;
+      release(&c->mag[id].lock);
+    }
+    // active: 调用者持有的对象, 不包括 magazine 中的
+    printf("%s: objsize %d active %d/%d slabs %d cached %d alloc %d free %d\n",
+           c->name, c->objsize, (int)(nalloc - nfree), c->nslab * c->nperslab,
+           c->nslab, cached, (int)nalloc, (int)nfree);
+  }
+  release(&slab_lock);
+  printf("===================================================\n");
+}
+
+void
+slabinit()
+{
+  initlock(&slab_lock, "slab");
+}
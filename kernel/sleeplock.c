@@ -31,6 +31,23 @@ acquiresleeplock(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+// 锁空闲时拿到锁返回1, 否则立即返回0, 不睡眠
+int
+tryacquiresleeplock(struct sleeplock *lk)
+{
+  int r = 0;
+
+  acquire(&lk->lk);
+  if(!lk->locked)
+  {
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+    r = 1;
+  }
+  release(&lk->lk);
+  return r;
+}
+
 int holdingsleep(struct sleeplock *lk)
 {
   int r;
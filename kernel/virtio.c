@@ -10,6 +10,8 @@
 #include "buf.h"
 #include "virtio.h"
 #include "proc.h"
+#include "kalloc.h"
+#include "timer.h"
 #include "defs.h"
 
 // 私有结构体
@@ -43,15 +45,37 @@ static struct disk {
   // indexed by first descriptor index of chain.
   struct {
     struct buf *buf;      // @s xv6 -> struct buf
-    int finish;
     char status;
+    uint64 start;         // 提交时间, 统计延迟用
   } info[NUM];
 
   // 用于存储磁盘命令头信息。
   // 与描述符一一对应
   struct virtio_blk_req ops[NUM];
+
+  // 协商到 INDIRECT_DESC 时, 每个请求在环中只占一个描述符,
+  // 指向该描述符对应的间接描述符表
+  int indirect;
+  struct virtq_desc indtab[NUM][MAXSEG + 2];
   
   struct spinlock vdisk_lock;
+
+  // 批量提交: plugged 不为0时新请求只放入 avail 环, 不更新 avail->idx,
+  // 等 unplug 时一起交给设备, 只通知一次
+  int plugged;
+  uint16 pending;  // 已放入 avail 环但还没有交给设备的请求数
+  uint16 kicked;   // 上次通知设备时的 avail->idx
+
+  // 协商到 EVENT_IDX 时, 只在设备要求时通知, 中断也可以合并
+  int event_idx;
+  int inflight;    // 已交给设备还没有完成的请求数
+
+  // 统计
+  uint64 nreq;
+  uint64 nkick;
+  uint64 nintr;
+  uint64 npolled;  // 由轮询完成的请求数
+  uint64 lat[LAT_BUCKETS];
   
 } disk;
 
@@ -111,9 +135,9 @@ devinit()
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -139,14 +163,11 @@ devinit()
     panic("virtio disk max queue too short");
 
   // 分配物理地址连续空间
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
+  disk.desc = kalloc_flags(KALLOC_ZERO);
+  disk.avail = kalloc_flags(KALLOC_ZERO);
+  disk.used = kalloc_flags(KALLOC_ZERO);
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   // set queue size.
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -219,12 +240,43 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+/*
+ * 每个请求占 n + 2 个描述符(头部, n 个数据, 状态), 不需要连续;
+ * 设备支持间接描述符时只占环中的一个, 指向 indtab 中的表.
+ * 把放入 avail 环的请求交给设备, 通知一次
+ * 调用者持有 vdisk_lock
+*/
+static void
+virtio_kick(void)
+{
+  if(disk.pending == 0)
+    return;
+
+  __sync_synchronize();
+
+  // tell the device another avail ring entry is available.
+  disk.avail->idx += disk.pending; // not % NUM ...
+  disk.pending = 0;
+
+  __sync_synchronize();
+
+  // 设备还在处理 avail 环时不需要再通知
+  if (disk.event_idx &&
+      !VRING_NEED_EVENT(disk.used->avail_event, disk.avail->idx, disk.kicked))
+    return;
+  disk.kicked = disk.avail->idx;
+
+  // qemu mmio control register mapped 0x10001000 
+  // VIRTIO_MMIO_QUEUE_NOTIFY -> write-only
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+  disk.nkick++;
+}
+
+// 分配 n 个描述符, 不够时一个也不分配
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -235,30 +287,66 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-static void
-virtioRw(struct buf *buf, uint64 sector, int write)   // sector 磁盘的扇区 buf 存放数据的缓冲区 write 读/写磁盘
+static void virtio_reap(int polled);
+
+/*
+ * 提交一个读写请求后立即返回, 只在没有空闲描述符时睡眠.
+ * 请求完成时 virtiointr 清除 buf->disk, 唤醒 virtio_wait 并调用 buf->end_io
+*/
+void
+virtio_submit(struct buf *buf, int sectorno, int write)   // sector 磁盘的扇区 buf 存放数据的缓冲区 write 读/写磁盘
 {
-  /* for test */
-  if (write)
-    printf("virtio_disk: write sector %d\n", sector);
-  else
-    printf("virtio_disk: read sector %d\n", sector);
+  if (buf->sectorno != sectorno)
+    panic("virtio_submit");
+  virtio_submit_sg(&buf, 1, write);
+}
 
+/*
+ * 扇区连续的 n 个缓冲块组成一个请求: 头部, n 个数据描述符, 状态,
+ * 设备只处理一次, 只产生一次中断. 每个缓冲块完成时同 virtio_submit
+*/
+void
+virtio_submit_sg(struct buf **bufs, int n, int write)
+{
+  uint64 sector = bufs[0]->sectorno;
+  int idx[MAXSEG + 2];
+  struct virtq_desc *dp[MAXSEG + 2];  // 请求的各个描述符
+  uint16 nx[MAXSEG + 2];              // 各描述符的 next
+  int i, ndesc;
+
+  if (n < 1 || n > MAXSEG)
+    panic("virtio_submit_sg");
+  for (i = 1; i < n; i++) {
+    if (bufs[i]->sectorno != bufs[i-1]->sectorno + bufs[i-1]->size / BSIZE)
+      panic("virtio_submit_sg: not contiguous");
+  }
 
   acquire(&disk.vdisk_lock);
 
-  int idx[3];
-
   // disk.desc描述一个物理内存块，用一个描述符数组(idx)集中管理所有的描述符
   // 如何分配成功就开始读/写
   // 否则就说明有进程占用了设备的输入输出资源
   // 就会睡眠,等待
+  ndesc = disk.indirect ? 1 : n + 2;
   while (1) {
-    if (alloc3_desc(idx) == 0)
+    if (allocn_desc(idx, ndesc) == 0)
       break;
+    // 先把攒着的请求交给设备, 否则可能永远等不到空闲描述符
+    virtio_kick();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
+  // 间接描述符表中按下标顺序连接, 否则用环中分到的描述符
+  for (i = 0; i < n + 2; i++) {
+    if (disk.indirect) {
+      dp[i] = &disk.indtab[idx[0]][i];
+      nx[i] = i + 1;
+    } else {
+      dp[i] = &disk.desc[idx[i]];
+      nx[i] = i + 1 < n + 2 ? idx[i+1] : 0;
+    }
+  }
+
   struct virtio_blk_req *req = &disk.ops[idx[0]];
 
   if (write)
@@ -270,57 +358,183 @@ virtioRw(struct buf *buf, uint64 sector, int write)   // sector 磁盘的扇区
 
   req->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64)req;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64)buf;
-  disk.desc[idx[1]].len = BSIZE;
-  if (write)
-    disk.desc[idx[1]].flags = 0;
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE;
+  dp[0]->addr = (uint64)req;
+  dp[0]->len = sizeof(struct virtio_blk_req);
+  dp[0]->flags = VRING_DESC_F_NEXT;
+  dp[0]->next = nx[0];
+
+  // 每个缓冲块一个数据描述符, 簇缓冲块一次传输多个扇区
+  for (i = 1; i <= n; i++) {
+    dp[i]->addr = (uint64)bufs[i-1]->data;
+    dp[i]->len = bufs[i-1]->size;
+    if (write)
+      dp[i]->flags = 0;
+    else
+      dp[i]->flags = VRING_DESC_F_WRITE;
 
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    dp[i]->flags |= VRING_DESC_F_NEXT;
+    dp[i]->next = nx[i];
+  }
 
   disk.info[idx[0]].status = 0xff;
 
-  disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE;
-  disk.desc[idx[2]].next = 0;
+  dp[n+1]->addr = (uint64)&disk.info[idx[0]].status;
+  dp[n+1]->len = 1;
+  dp[n+1]->flags = VRING_DESC_F_WRITE;
+  dp[n+1]->next = 0;
+
+  // 环中的描述符指向间接描述符表
+  if (disk.indirect) {
+    disk.desc[idx[0]].addr = (uint64)disk.indtab[idx[0]];
+    disk.desc[idx[0]].len = (n + 2) * sizeof(struct virtq_desc);
+    disk.desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[idx[0]].next = 0;
+  }
 
   // record struct buf for virtio_disk_intr().
-  disk.info[idx[0]].finish = 0;
-  disk.info[idx[0]].buf = buf;
+  // 同一个请求的缓冲块通过 iolink 串起来
+  for (i = 0; i < n; i++) {
+    bufs[i]->disk = 1;
+    bufs[i]->iolink = i + 1 < n ? bufs[i+1] : 0;
+  }
+  disk.info[idx[0]].buf = bufs[0];
+  disk.info[idx[0]].start = r_time();
+  disk.inflight++;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.avail->ring[(disk.avail->idx + disk.pending) % NUM] = idx[0];
+  disk.pending++;
+  disk.nreq++;
 
-  __sync_synchronize();
+  if (!disk.plugged)
+    virtio_kick();
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  release(&disk.vdisk_lock);
+}
 
-  __sync_synchronize();
+// 开始一批请求
+void
+virtio_plug(void)
+{
+  acquire(&disk.vdisk_lock);
+  disk.plugged++;
+  release(&disk.vdisk_lock);
+}
 
-  // qemu mmio control register mapped 0x10001000 
-  // VIRTIO_MMIO_QUEUE_NOTIFY -> write-only
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+// 结束一批请求, 一次性交给设备
+void
+virtio_unplug(void)
+{
+  acquire(&disk.vdisk_lock);
+  if (--disk.plugged == 0)
+    virtio_kick();
+  release(&disk.vdisk_lock);
+}
+
+// 等待 buf 上的请求完成
+// 小请求先自旋等一会儿, 设备很快完成时省掉中断和两次进程切换
+void
+virtio_wait(struct buf *buf)
+{
+  if (VIRTIO_POLL_US > 0 && buf->size <= VIRTIO_POLL_SIZE) {
+    uint64 end = r_time() + VIRTIO_POLL_US * (CLOCK_FREQ / 1000000);
+    while (buf->disk && r_time() < end) {
+      __sync_synchronize();
+      if (disk.used_idx != disk.used->idx)
+        virtio_reap(1);
+    }
+  }
 
-  while (disk.info[idx[0]].finish == 0) {
+  acquire(&disk.vdisk_lock);
+  while (buf->disk) {
     // 等待 virtiointr() 发出请求已完成的信号
     sleep(buf, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+
+  // 中断中不派发, 设备空出的位置由这里交给排队的请求
+  disk_kick();
+}
+
+static void
+virtioRw(struct buf *buf, uint64 sector, int write)
+{
+  virtio_submit(buf, sector, write);
+  virtio_wait(buf);
+}
+
+/*
+ * 处理 used 环中已经完成的请求, 中断和轮询都从这里进入.
+ * 开启 EVENT_IDX 时, 让设备在还在处理的请求完成一半后再中断,
+ * 设置完后再检查一次 used 环, 避免漏掉刚完成的请求
+*/
+static void
+virtio_reap(int polled)
+{
+  struct buf *done = 0;   // 要调用 end_io 的缓冲块, 通过 qnext 串起来
+  uint64 lat;
+  int i;
+
+  acquire(&disk.vdisk_lock);
+
+  // the device increments disk.used->idx when it
+  // adds an entry to the used ring.
+again:
+  while(disk.used_idx != disk.used->idx){
+    __sync_synchronize();
+    int id = disk.used->ring[disk.used_idx % NUM].id;
+
+    if(disk.info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    // 延迟按微秒取对数放入直方图
+    lat = (r_time() - disk.info[id].start) / (CLOCK_FREQ / 1000000);
+    for(i = 0; i < LAT_BUCKETS - 1 && (lat >> (i + 1)); i++)
+      ;
+    disk.lat[i]++;
+    disk.inflight--;
+    if(polled)
+      disk.npolled++;
+
+    struct buf *b = disk.info[id].buf, *next;
+    disk.info[id].buf = 0;
+    free_chain(id);
+    // 已经派发的缓冲块不在调度队列中, qnext 可以借用
+    for(; b; b = next){
+      next = b->iolink;
+      b->iolink = 0;
+      b->disk = 0;
+      wakeup(b);
+      if(b->end_io){
+        b->qnext = done;
+        done = b;
+      }
+    }
+
+    disk.used_idx += 1;
+  }
+
+  if(disk.event_idx){
+    // 还有请求在设备中时, 完成一半再中断; 都完成了就在下一个完成时中断
+    disk.avail->used_event = disk.used_idx + (disk.inflight > 1 ? disk.inflight / 2 : 1) - 1;
+    __sync_synchronize();
+    if(disk.used_idx != disk.used->idx)
+      goto again;
+  }
 
-  disk.info[idx[0]].buf = 0;
-  free_chain(idx[0]);
   release(&disk.vdisk_lock);
 
-  /* for test */
-  printf("virtio read down.\n");
+  // 完成回调可能释放缓冲块, 不持有 vdisk_lock 调用
+  for(struct buf *b = done, *next; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->end_io(b);
+  }
+
+  // 设备有空位了, 让 I/O 调度器继续派发. 派发可能要睡眠等描述符,
+  // 不能在中断中做, 由等待者和写回线程派发
+  if(polled)
+    disk_kick();
 }
 
 // trap.c 在处理设备发出的中断时需要调用
@@ -328,8 +542,6 @@ virtioRw(struct buf *buf, uint64 sector, int write)   // sector 磁盘的扇区
 void
 virtiointr()
 {
-  acquire(&disk.vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -339,24 +551,44 @@ virtiointr()
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
+  __sync_fetch_and_add(&disk.nintr, 1);
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  virtio_reap(0);
+}
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+// 设备中还没有完成的请求数
+int
+virtio_inflight(void)
+{
+  return disk.inflight;
+}
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+// 保证不用等待描述符就能同时提交的请求数
+int
+virtio_depth(void)
+{
+  return disk.indirect ? NUM : NUM / (MAXSEG + 2);
+}
 
-    disk.info[id].finish = 1;
-    wakeup(disk.info[id].buf);
+// 磁盘容量, 扇区数
+uint64
+virtio_capacity(void)
+{
+  return *(volatile uint64 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG);
+}
 
-    disk.used_idx += 1;
+// 输出请求数, 通知和中断次数, 以及完成延迟的直方图
+void
+virtio_info(void)
+{
+  printf("===================================================\n");
+  printf("virtio: %d reqs, %d kicks, %d intrs, %d polled\n",
+         (int)disk.nreq, (int)disk.nkick, (int)disk.nintr, (int)disk.npolled);
+  for(int i = 0; i < LAT_BUCKETS; i++){
+    if(disk.lat[i])
+      printf("  %d us ~: %d\n", 1 << i, (int)disk.lat[i]);
   }
-
-  release(&disk.vdisk_lock);
+  printf("===================================================\n");
 }
 
 // 提供使用的接口函数
@@ -373,3 +605,65 @@ Virtiowrite(struct buf* buf, int sectorno)
 {
   virtioRw(buf, sectorno, 1);
 }
+
+#ifdef BENCH
+#define VBENCH_IOS   512
+#define VBENCH_DEPTH NUM
+
+/*
+ * 队列深度测试: 保持 depth 个读请求在设备中, depth 从1到 NUM/3
+ * (支持间接描述符时到 NUM),
+ * 输出每秒完成的请求数. 启动时中断还没打开, 自己调用 virtiointr() 轮询完成
+*/
+void
+virtio_bench(void)
+{
+  static struct buf vb[VBENCH_DEPTH];
+  int depth, k, sent, done;
+  uint64 t, nkick;
+
+  for(k = 0; k < VBENCH_DEPTH; k++){
+    vb[k].size = BSIZE;
+    vb[k].end_io = 0;
+    if((vb[k].data = kalloc()) == 0)
+      panic("virtio_bench");
+  }
+
+  int maxdepth = disk.indirect ? NUM : NUM / 3;
+
+  for(depth = 1; depth <= maxdepth; depth++){
+    sent = done = 0;
+    nkick = disk.nkick;
+    t = r_time();
+    while(done < VBENCH_IOS){
+      // 空出来的槽位一批提交
+      virtio_plug();
+      for(k = 0; k < depth && sent < VBENCH_IOS; k++){
+        if(vb[k].disk == 0 && vb[k].valid == 0){
+          vb[k].sectorno = (sent * 8) % 4096;
+          vb[k].valid = 1;    // 借用 valid 表示槽位在使用
+          virtio_submit(&vb[k], vb[k].sectorno, 0);
+          sent++;
+        }
+      }
+      virtio_unplug();
+
+      virtiointr();
+      for(k = 0; k < depth; k++){
+        if(vb[k].valid && vb[k].disk == 0){
+          vb[k].valid = 0;
+          done++;
+        }
+      }
+    }
+    t = r_time() - t;
+    t = t ? t : 1;
+    printf("[bench] virtio depth %d: %d IOPS, %d kicks\n", depth,
+           (int)(VBENCH_IOS * (uint64)CLOCK_FREQ / t),
+           (int)(disk.nkick - nkick));
+  }
+
+  for(k = 0; k < VBENCH_DEPTH; k++)
+    kfree(vb[k].data);
+}
+#endif
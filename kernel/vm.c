@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "proc.h"
+#include "kalloc.h"
 #include "defs.h"
 
 extern char etext[];
@@ -52,8 +53,7 @@ mappages(pagetable_t pgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 void
 kvminit()
 {
-  kernel_pagetable = (pagetable_t)kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
+  kernel_pagetable = (pagetable_t)kalloc_flags(KALLOC_ZERO);
 
   // uart 寄存器
   kvmmap(kernel_pagetable, UART, UART, PGSIZE, PTE_R | PTE_W);
@@ -218,9 +218,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pte_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pte_t*)kalloc_flags(KALLOC_ZERO)) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -233,10 +232,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_flags(KALLOC_ZERO);
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -248,13 +246,11 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 {
   char *mem;
 
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_flags(KALLOC_ZERO);
   mappages(pagetable, 0, (uint64)mem, PGSIZE, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_flags(KALLOC_ZERO);
   mappages(pagetable, 4096, (uint64)mem, PGSIZE, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src + 4096, sz - 4096);
 }
@@ -28,6 +28,16 @@ CFLAGS += -ffreestanding -fno-common -nostdlib -mno-relax
 CFLAGS += -I$(LIB_PATH)
 CFLAGS += $(shell $(CC) -fno-stack-protector -E -x c /dev/null >/dev/null 2>&1 && echo -fno-stack-protector)
 
+# make KDEBUG=1: kalloc/kfree 用垃圾数据填充整页, 便于发现未初始化或释放后使用
+ifeq ($(KDEBUG), 1)
+CFLAGS += -DKALLOC_DEBUG
+endif
+
+# make BENCH=1: 启动时运行内核微基准测试
+ifeq ($(BENCH), 1)
+CFLAGS += -DBENCH
+endif
+
 LDFLAGS = -z max-page-size=4096
 
 .gdbinit: .gdbinit.tmpl-riscv